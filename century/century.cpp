@@ -1,71 +1,177 @@
 #include <vector>
+#include <string>
 #include <iostream>
 #include <numeric>
 #include <algorithm>
 #include <iterator>
+#include <cstdint>
+#include <cassert>
+#include <limits>
+#include <stdexcept>
+#include <tuple>
 
 #include "../common/benchmark.h"
+#include "../common/work_stealing_pool.h"
 
 using namespace std;
 
+// Arithmetic on non-negative values that sticks at a cap well above any
+// target instead of overflowing; a capped value times zero is still zero.
+const long long saturation_cap = numeric_limits<long long>::max()/4;
+
+long long
+saturating_mul(long long a, long long b)
+{
+    if (a != 0 && b > saturation_cap/a)
+        return saturation_cap;
+    return min(a*b, saturation_cap);
+}
+
+long long
+saturating_add(long long a, long long b)
+{
+    return min(a + b, saturation_cap);
+}
+
+// An expression over a digit string, kept in a fixed-size, allocation-free
+// form: the digits and one operator code per gap between them are packed
+// into integers, and the value is maintained incrementally as
+// sum + product*factor, where factor is the number being written, product
+// the rest of the current term and sum all previous terms.  A number of up
+// to max_digits digits does not fit a long long, so the parts saturate:
+// each is its true value, or saturation_cap if that is larger, and so
+// compares like the true value against any target.  Appending a digit
+// beyond max_digits throws length_error.
 class Expression
 {
     public:
-        Expression() : terms_() {}
+        static const unsigned int max_digits = 32;
+
+        Expression() : digits_{0, 0}, gaps_(0), size_(0), sum_(0), product_(0), factor_(0) {}
 
         Expression add_digit(int digit) const {
             Expression result(*this);
-            Factor &last_factor = result.terms_.back().back();
-            last_factor = last_factor*10 + digit;
+            result.push(digit, gap_digit);
+            result.factor_ = saturating_add(saturating_mul(factor_, 10), digit);
             return result;
         }
 
         Expression add_factor(int digit) const {
             Expression result(*this);
-            Term &last_term = result.terms_.back();
-            last_term.push_back(digit);
+            result.push(digit, gap_factor);
+            result.product_ = saturating_mul(product_, factor_);
+            result.factor_ = digit;
             return result;
         }
 
         Expression add_term(int digit) const {
             Expression result(*this);
-            Term new_term;
-            new_term.push_back(digit);
-            result.terms_.push_back(new_term);
+            result.push(digit, gap_term);
+            result.sum_ = value();
+            result.product_ = 1;
+            result.factor_ = digit;
             return result;
         }
 
+        // Numbers are printed from their digits, without leading zeros,
+        // as they may be too long for any integer type.
         void pretty_print() const {
-            const auto & term = terms_.front();
-            cout << term.front();
-            for (auto factor = begin(term) + 1; factor != end(term); ++factor)
-                cout << "*" << *factor;
-
-            for (auto term = begin(terms_) + 1; term != end(terms_); ++term) {
-                cout << " + ";
-                cout << term->front();
-                for (auto factor = begin(*term) + 1; factor != end(*term); ++factor)
-                    cout << "*" << *factor;
+            string factor;
+            for (unsigned int i = 0; i < size_; ++i) {
+                unsigned int gap = gap_before(i);
+                if (gap != gap_digit) {
+                    cout << factor << (gap == gap_factor ? "*" : " + ");
+                    factor.clear();
+                }
+                if (factor == "0")
+                    factor.clear();
+                factor += static_cast<char>('0' + digit(i));
             }
+            cout << factor;
 
             cout << " = " << value();
             cout << endl;
         }
 
-        int value() const {
-            return accumulate(begin(terms_), end(terms_), 0,
-                    [](int a, const Term &t) {
-                        return a + accumulate(begin(t), end(t), 1, multiplies<int>());
-                    });
+        long long value() const {
+            return saturating_add(sum_, saturating_mul(product_, factor_));
+        }
+
+        // The value recomputed from the digits and operators alone, without
+        // saturation: no expression of max_digits digits reaches 10^32.
+        unsigned __int128 exact_value() const {
+            unsigned __int128 sum = 0, product = 1, factor = 0;
+            for (unsigned int i = 0; i < size_; ++i) {
+                unsigned int gap = gap_before(i);
+                if (gap == gap_factor) {
+                    product *= factor;
+                    factor = 0;
+                } else if (gap == gap_term) {
+                    sum += product*factor;
+                    product = 1;
+                    factor = 0;
+                }
+                factor = factor*10 + digit(i);
+            }
+            return sum + product*factor;
+        }
+
+        bool empty() const { return size_ == 0; }
+        unsigned int size() const { return size_; }
+
+        // The parts of value(): completed terms, the rest of the current
+        // term, and the number being written.
+        long long sum() const { return sum_; }
+        long long product() const { return product_; }
+        long long factor() const { return factor_; }
+
+        // Orders expressions by their digits and operators, so result sets
+        // can be compared regardless of the order they were found in.
+        bool operator<(const Expression &other) const {
+            if (size_ != other.size_)
+                return size_ < other.size_;
+            if (digits_[1] != other.digits_[1])
+                return digits_[1] < other.digits_[1];
+            if (digits_[0] != other.digits_[0])
+                return digits_[0] < other.digits_[0];
+            return gaps_ < other.gaps_;
         }
 
-        bool empty() const { return terms_.size() == 0; }
+        bool operator==(const Expression &other) const {
+            return size_ == other.size_ && digits_[0] == other.digits_[0] &&
+                digits_[1] == other.digits_[1] && gaps_ == other.gaps_;
+        }
 
     private:
-        typedef int Factor;
-        typedef vector<Factor> Term;
+        enum { gap_digit = 0, gap_factor = 1, gap_term = 2 };
+
+        int digit(unsigned int i) const {
+            return digits_[i/16] >> (4*(i % 16)) & 15;
+        }
+
+        // The operator between digits i - 1 and i; none before the first.
+        unsigned int gap_before(unsigned int i) const {
+            if (i == 0)
+                return gap_digit;
+            return gaps_ >> (2*(i - 1)) & 3;
+        }
+
+        // Appends a digit; the gap code is ignored for the first one.
+        void push(int digit, unsigned int gap) {
+            if (size_ == max_digits)
+                throw length_error("Expression: more than " + to_string(max_digits) + " digits");
+            if (size_ > 0)
+                gaps_ |= static_cast<uint64_t>(gap) << (2*(size_ - 1));
+            digits_[size_/16] |= static_cast<uint64_t>(digit) << (4*(size_ % 16));
+            ++size_;
+        }
 
-        vector<Term> terms_;
+        uint64_t digits_[2];
+        uint64_t gaps_;
+        unsigned int size_;
+        long long sum_;
+        long long product_;
+        long long factor_;
 };
 
 vector<Expression>
@@ -129,7 +235,7 @@ search_helper(vector<Candidate> &output,
               vector<int>::const_iterator first_digit,
               vector<int>::const_iterator last_digit,
               const Candidate &current,
-              Generator g, PredicateGood good, PredicateOK ok) {
+              const Generator &g, const PredicateGood &good, const PredicateOK &ok) {
 
     if (first_digit == last_digit) {
         if (good(current))
@@ -157,6 +263,238 @@ search(const vector<int> &digits, const vector<Candidate> &initial, const Genera
     return result;
 }
 
+// Expands the first split_depth levels of the tree on the calling thread
+// and searches each subtree below them as a task on the pool.  Every task
+// appends to its own buffer, and the buffers are joined in frontier order,
+// so the result is the same, in the same order, as search().  With
+// split_depth == 0 the frontier is deepened until there are about
+// tasks_per_thread subtrees for every worker.
+template<class Candidate, class Generator, class PredicateGood, class PredicateOK>
+vector<Candidate>
+parallel_search(WorkStealingPool &pool, const vector<int> &digits, const vector<Candidate> &initial,
+                const Generator &g, PredicateGood good, PredicateOK ok,
+                size_t split_depth=0, size_t tasks_per_thread=16)
+{
+    size_t max_depth = split_depth == 0 ? digits.size() : min(split_depth, digits.size());
+    size_t min_tasks = tasks_per_thread*pool.size();
+
+    vector<Candidate> frontier(initial);
+    size_t depth = 0;
+    while (depth < max_depth && (split_depth != 0 || frontier.size() < min_tasks)) {
+        vector<Candidate> next;
+        for (const auto &node : frontier) {
+            for (auto candidate : g(node, digits[depth])) {
+                if (ok(candidate))
+                    next.push_back(candidate);
+            }
+        }
+        frontier.swap(next);
+        ++depth;
+    }
+
+    vector<vector<Candidate>> outputs(frontier.size());
+    WorkStealingPool::TaskGroup group;
+    for (size_t i = 0; i < frontier.size(); ++i) {
+        pool.spawn(group, [&, i] {
+                search_helper(outputs[i], begin(digits) + depth, end(digits),
+                              frontier[i], g, good, ok);
+            });
+    }
+    pool.wait(group);
+
+    vector<Candidate> result;
+    for (const auto &output : outputs)
+        result.insert(end(result), begin(output), end(output));
+    return result;
+}
+
+// search() as a pull-based stream: next() resumes the depth-first walk
+// where the previous call left it and stops at the next good candidate, in
+// the same order search() would report them.  The walk keeps one frame of
+// accepted children per level, so memory stays bounded by the depth of the
+// tree, and a caller may stop pulling at any time.
+template<class Candidate, class Generator, class PredicateGood, class PredicateOK>
+class SearchStream
+{
+    public:
+        class iterator
+        {
+            public:
+                typedef input_iterator_tag iterator_category;
+                typedef Candidate value_type;
+                typedef ptrdiff_t difference_type;
+                typedef const Candidate *pointer;
+                typedef const Candidate &reference;
+
+                iterator() : stream_(nullptr) {}
+                explicit iterator(SearchStream *stream) : stream_(stream) { ++*this; }
+
+                reference operator*() const { return current_; }
+                pointer operator->() const { return &current_; }
+
+                iterator &operator++() {
+                    if (!stream_->next(current_))
+                        stream_ = nullptr;
+                    return *this;
+                }
+
+                bool operator==(const iterator &other) const { return stream_ == other.stream_; }
+                bool operator!=(const iterator &other) const { return stream_ != other.stream_; }
+
+            private:
+                SearchStream *stream_;
+                Candidate current_;
+        };
+
+        SearchStream(const vector<int> &digits, const vector<Candidate> &initial,
+                     Generator g, PredicateGood good, PredicateOK ok) :
+            g_(g), good_(good), ok_(ok), digits_(digits), frames_(digits.size() + 1), depth_(0)
+        {
+            frames_[0].candidates = initial;
+        }
+
+        bool next(Candidate &result) {
+            while (depth_ != npos) {
+                Frame &top = frames_[depth_];
+                if (top.next == top.candidates.size()) {
+                    --depth_;
+                    continue;
+                }
+                const Candidate &current = top.candidates[top.next++];
+                if (depth_ == digits_.size()) {
+                    if (good_(current)) {
+                        result = current;
+                        return true;
+                    }
+                    continue;
+                }
+
+                Frame &child = frames_[depth_ + 1];
+                child.candidates = g_(current, digits_[depth_]);
+                child.candidates.erase(remove_if(child.candidates.begin(), child.candidates.end(),
+                            [this](const Candidate &c) { return !ok_(c); }),
+                        child.candidates.end());
+                child.next = 0;
+                ++depth_;
+            }
+            return false;
+        }
+
+        // The stream is consumed as it is iterated; begin() resumes it.
+        iterator begin() { return iterator(this); }
+        iterator end() { return iterator(); }
+
+    private:
+        static const size_t npos = static_cast<size_t>(-1);
+
+        struct Frame
+        {
+            Frame() : next(0) {}
+
+            vector<Candidate> candidates;
+            size_t next;
+        };
+
+        Generator g_;
+        PredicateGood good_;
+        PredicateOK ok_;
+
+        // frames_[d] holds the accepted candidates that consumed d digits;
+        // those above depth_ are stale.
+        vector<int> digits_;
+        vector<Frame> frames_;
+        size_t depth_;
+};
+
+template<class Candidate, class Generator, class PredicateGood, class PredicateOK>
+SearchStream<Candidate, Generator, PredicateGood, PredicateOK>
+search_stream(const vector<int> &digits, const vector<Candidate> &initial,
+              Generator g, PredicateGood good, PredicateOK ok)
+{
+    return SearchStream<Candidate, Generator, PredicateGood, PredicateOK>(digits, initial, g, good, ok);
+}
+
+// The range of values any completion of a partial candidate can reach.
+struct ValueBounds
+{
+    long long lower;
+    long long upper;
+};
+
+// An ok predicate for search() built from a bound, i.e. any callable that
+// maps a candidate to its ValueBounds: a candidate is kept while the target
+// lies in its range.  Admissible bounds never lose a solution.
+template<class Bound>
+class WithinBounds
+{
+    public:
+        WithinBounds(Bound bound, long long target) : bound_(bound), target_(target) {}
+
+        template<class Candidate>
+        bool operator()(const Candidate &c) const {
+            auto b = bound_(c);
+            return b.lower <= target_ && target_ <= b.upper;
+        }
+
+    private:
+        Bound bound_;
+        long long target_;
+};
+
+template<class Bound>
+WithinBounds<Bound>
+within_bounds(Bound bound, long long target)
+{
+    return WithinBounds<Bound>(bound, target);
+}
+
+// Admissible bounds for an Expression over a fixed digit string, from the
+// digits it has not consumed yet.  Upwards, writing every remaining digit
+// into the current factor reaches at least as much as any other choice,
+// since a*b and a + b never exceed a*10^len(b) + b; when the term is
+// already zero, the remaining digits can only start new terms.
+// Downwards, the current term never shrinks unless a remaining factor can
+// be zero, so it is dropped from the lower bound only while a 0 is left.
+// Both bounds are computed with saturating arithmetic, so a bound past the
+// cap compares like the true one against any target.
+class ExpressionBounds
+{
+    public:
+        explicit ExpressionBounds(const vector<int> &digits) :
+            rest_value_(digits.size() + 1, 0),
+            rest_scale_(digits.size() + 1, 1),
+            rest_zero_(digits.size() + 1, false)
+        {
+            for (size_t i = digits.size(); i-- > 0; ) {
+                rest_scale_[i] = saturating_mul(rest_scale_[i + 1], 10);
+                rest_value_[i] = saturating_add(saturating_mul(digits[i], rest_scale_[i + 1]),
+                                                rest_value_[i + 1]);
+                rest_zero_[i] = rest_zero_[i + 1] || digits[i] == 0;
+            }
+        }
+
+        ValueBounds operator()(const Expression &e) const {
+            size_t next = e.size();
+            long long term = saturating_mul(e.product(), e.factor());
+
+            ValueBounds b;
+            b.lower = saturating_add(e.sum(), rest_zero_[next] ? 0 : term);
+            if (e.product() == 0) {
+                b.upper = saturating_add(e.sum(), rest_value_[next]);
+            } else {
+                long long factor = saturating_add(saturating_mul(e.factor(), rest_scale_[next]),
+                                                  rest_value_[next]);
+                b.upper = saturating_add(e.sum(), saturating_mul(e.product(), factor));
+            }
+            return b;
+        }
+
+    private:
+        vector<long long> rest_value_;
+        vector<long long> rest_scale_;
+        vector<bool> rest_zero_;
+};
+
 
 vector<Expression>
 fast_solutions(const vector<int> &digits, int target_value=100)
@@ -167,50 +505,534 @@ fast_solutions(const vector<int> &digits, int target_value=100)
     auto expressions = search(digits, initial,
             [](const Expression & e, int digit) { return generate(e, digit); },
             [target_value](const Expression &e) { return e.value() == target_value; },
-            [target_value](const Expression &e) { return e.value() <= target_value; });
+            within_bounds(ExpressionBounds(digits), target_value));
 
     return expressions;
 }
 
+vector<Expression>
+parallel_solutions(WorkStealingPool &pool, const vector<int> &digits, int target_value=100)
+{
+    vector<Expression> initial;
+    initial.push_back(Expression());
+
+    return parallel_search(pool, digits, initial,
+            [](const Expression & e, int digit) { return generate(e, digit); },
+            [target_value](const Expression &e) { return e.value() == target_value; },
+            within_bounds(ExpressionBounds(digits), target_value));
+}
+
+// Named counterparts of fast_solutions()' lambdas, so the type of its
+// stream can be spelled out.
+struct GenerateExpressions
+{
+    vector<Expression> operator()(const Expression &e, int digit) const {
+        return generate(e, digit);
+    }
+};
+
+struct HasValue
+{
+    explicit HasValue(long long target) : target(target) {}
+
+    bool operator()(const Expression &e) const { return e.value() == target; }
+
+    long long target;
+};
+
+typedef SearchStream<Expression, GenerateExpressions, HasValue, WithinBounds<ExpressionBounds>> SolutionStream;
+
+// fast_solutions() one at a time.
+SolutionStream
+solution_stream(const vector<int> &digits, int target_value=100)
+{
+    return search_stream(digits, vector<Expression>(1, Expression()),
+            GenerateExpressions(), HasValue(target_value),
+            within_bounds(ExpressionBounds(digits), target_value));
+}
+
+// Meet in the middle: every expression is cut at the gap before digit
+// `cut` into a prefix, an Expression over the digits before it, and a
+// Suffix over the rest, each half enumerated with pruning on its own.
+// Where the cut gap is a '+' the halves meet only through their values;
+// otherwise they share the term spanning the cut, so each half is grouped
+// by its part of that term and matching groups are joined on the sums of
+// their closed terms.  Joins walk two sorted ranges from opposite ends.
+enum Gap { digit_gap, factor_gap, term_gap };
+
+Expression
+append(const Expression &e, int digit, Gap gap)
+{
+    switch (gap) {
+        case digit_gap:
+            return e.add_digit(digit);
+        case factor_gap:
+            return e.add_factor(digit);
+        default:
+            return e.add_term(digit);
+    }
+}
+
+// The digits after the cut, built from the last one backwards: rest is
+// the value of the terms after the first, multiplier the product of the
+// first term's later factors, factor its leading number and scale the
+// power of ten above that.  Gap i of the suffix is kept in bits 2i, 2i + 1.
+struct Suffix
+{
+    long long rest;
+    long long multiplier;
+    long long factor;
+    long long scale;
+    uint64_t gaps;
+
+    long long term() const { return saturating_mul(multiplier, factor); }
+    long long value() const { return saturating_add(rest, term()); }
+};
+
+// Extends current, whose first digit is digits[position], to the left
+// until it starts at the cut.  The leading term only grows while there is
+// no 0 before it, so it counts towards the lower bound until then.
+void
+suffix_helper(vector<Suffix> &output, const vector<int> &digits, size_t cut, size_t position,
+              const Suffix &current, const vector<bool> &zero_before, long long target_value)
+{
+    long long lower = saturating_add(current.rest, zero_before[position] ? 0 : current.term());
+    if (lower > target_value)
+        return;
+    if (position == cut) {
+        output.push_back(current);
+        return;
+    }
+
+    int digit = digits[position - 1];
+    unsigned int shift = 2*(position - 1 - cut);
+
+    Suffix next = current;
+    next.factor = saturating_add(saturating_mul(digit, current.scale), current.factor);
+    next.scale = saturating_mul(current.scale, 10);
+    next.gaps = current.gaps | static_cast<uint64_t>(digit_gap) << shift;
+    suffix_helper(output, digits, cut, position - 1, next, zero_before, target_value);
+
+    next = current;
+    next.multiplier = current.term();
+    next.factor = digit;
+    next.scale = 10;
+    next.gaps = current.gaps | static_cast<uint64_t>(factor_gap) << shift;
+    suffix_helper(output, digits, cut, position - 1, next, zero_before, target_value);
+
+    next = current;
+    next.rest = current.value();
+    next.multiplier = 1;
+    next.factor = digit;
+    next.scale = 10;
+    next.gaps = current.gaps | static_cast<uint64_t>(term_gap) << shift;
+    suffix_helper(output, digits, cut, position - 1, next, zero_before, target_value);
+}
+
+// Calls sink on every pair of runs, one from each sorted range, whose
+// values add up to need.
+template<class Left, class Right, class LeftValue, class RightValue, class Sink>
+void
+join_on_sum(const Left *left, const Left *left_end, const Right *right, const Right *right_end,
+            long long need, LeftValue left_value, RightValue right_value, Gap gap, Sink &sink)
+{
+    while (left != left_end && right != right_end) {
+        long long l = left_value(*left);
+        long long r = right_value(*(right_end - 1));
+        if (l + r < need) {
+            ++left;
+        } else if (l + r > need) {
+            --right_end;
+        } else {
+            auto left_run = left;
+            while (left_run != left_end && left_value(*left_run) == l)
+                ++left_run;
+            auto right_run = right_end;
+            while (right_run != right && right_value(*(right_run - 1)) == r)
+                --right_run;
+            sink(left, left_run, right_run, right_end, gap);
+            left = left_run;
+            right_end = right_run;
+        }
+    }
+}
+
+// Splits a range sorted by key into its runs of equal keys.
+template<class T, class Key>
+vector<pair<const T *, const T *>>
+group_by(const vector<T> &sorted, Key key)
+{
+    vector<pair<const T *, const T *>> groups;
+    const T *first = sorted.data(), *last = first + sorted.size();
+    while (first != last) {
+        auto group_end = first + 1;
+        while (group_end != last && key(*group_end) == key(*first))
+            ++group_end;
+        groups.push_back(make_pair(first, group_end));
+        first = group_end;
+    }
+    return groups;
+}
+
+// The prefix gets the larger half, as the bounds prune it harder.
+size_t
+mitm_cut(size_t n_digits)
+{
+    return (n_digits + 1)/2;
+}
+
+template<class Sink>
+void
+meet_in_the_middle(const vector<int> &digits, long long target_value, Sink &sink)
+{
+    assert(digits.size() >= 2);
+    size_t cut = mitm_cut(digits.size());
+
+    vector<int> head(begin(digits), begin(digits) + cut);
+    vector<Expression> prefixes = search(head, vector<Expression>(1, Expression()),
+            [](const Expression & e, int digit) { return generate(e, digit); },
+            [](const Expression &) { return true; },
+            within_bounds(ExpressionBounds(digits), target_value));
+
+    vector<bool> zero_before(digits.size() + 1, false);
+    for (size_t i = 0; i < digits.size(); ++i)
+        zero_before[i + 1] = zero_before[i] || digits[i] == 0;
+    Suffix last = { 0, 1, digits.back(), 10, 0 };
+    vector<Suffix> suffixes;
+    suffix_helper(suffixes, digits, cut, digits.size() - 1, last, zero_before, target_value);
+
+    auto prefix_sum = [](const Expression &e) { return e.sum(); };
+    auto suffix_rest = [](const Suffix &s) { return s.rest; };
+
+    // A '+' at the cut.
+    sort(begin(prefixes), end(prefixes), [](const Expression &a, const Expression &b) {
+            return a.value() < b.value();
+        });
+    sort(begin(suffixes), end(suffixes), [](const Suffix &a, const Suffix &b) {
+            return a.value() < b.value();
+        });
+    join_on_sum(prefixes.data(), prefixes.data() + prefixes.size(),
+                suffixes.data(), suffixes.data() + suffixes.size(), target_value,
+                [](const Expression &e) { return e.value(); },
+                [](const Suffix &s) { return s.value(); }, term_gap, sink);
+
+    // A '*' at the cut: the halves of the term multiply.
+    auto prefix_term = [](const Expression &e) { return saturating_mul(e.product(), e.factor()); };
+    sort(begin(prefixes), end(prefixes), [&](const Expression &a, const Expression &b) {
+            return make_pair(prefix_term(a), a.sum()) < make_pair(prefix_term(b), b.sum());
+        });
+    sort(begin(suffixes), end(suffixes), [](const Suffix &a, const Suffix &b) {
+            return make_pair(a.term(), a.rest) < make_pair(b.term(), b.rest);
+        });
+    auto suffix_groups = group_by(suffixes, [](const Suffix &s) { return s.term(); });
+    for (auto p : group_by(prefixes, prefix_term)) {
+        long long a = prefix_term(*p.first);
+        for (auto s : suffix_groups) {
+            long long need = target_value - saturating_mul(a, s.first->term());
+            if (need < 0) {
+                if (a != 0)
+                    break;
+                continue;
+            }
+            join_on_sum(p.first, p.second, s.first, s.second, need,
+                        prefix_sum, suffix_rest, factor_gap, sink);
+        }
+    }
+
+    // No gap at the cut: the prefix's last factor runs into the suffix's
+    // leading one.
+    auto prefix_key = [](const Expression &e) { return make_pair(e.product(), e.factor()); };
+    auto suffix_key = [](const Suffix &s) { return make_tuple(s.scale, s.factor, s.multiplier); };
+    sort(begin(prefixes), end(prefixes), [&](const Expression &a, const Expression &b) {
+            return make_pair(prefix_key(a), a.sum()) < make_pair(prefix_key(b), b.sum());
+        });
+    sort(begin(suffixes), end(suffixes), [&](const Suffix &a, const Suffix &b) {
+            return make_pair(suffix_key(a), a.rest) < make_pair(suffix_key(b), b.rest);
+        });
+    suffix_groups = group_by(suffixes, suffix_key);
+    for (auto p : group_by(prefixes, prefix_key)) {
+        const Expression &e = *p.first;
+        for (auto s : suffix_groups) {
+            long long factor = saturating_add(saturating_mul(e.factor(), s.first->scale), s.first->factor);
+            long long term = saturating_mul(saturating_mul(e.product(), factor), s.first->multiplier);
+            long long need = target_value - term;
+            if (need < 0)
+                continue;
+            join_on_sum(p.first, p.second, s.first, s.second, need,
+                        prefix_sum, suffix_rest, digit_gap, sink);
+        }
+    }
+}
+
+// Sinks for meet_in_the_middle(): one counts the matching pairs, the other
+// rebuilds their expressions.
+struct CountingSink
+{
+    CountingSink() : count(0) {}
+
+    void operator()(const Expression *left, const Expression *left_end,
+                    const Suffix *right, const Suffix *right_end, Gap) {
+        count += static_cast<uint64_t>(left_end - left)*(right_end - right);
+    }
+
+    uint64_t count;
+};
+
+struct CollectingSink
+{
+    CollectingSink(const vector<int> &digits) : digits(digits), cut(mitm_cut(digits.size())) {}
+
+    void operator()(const Expression *left, const Expression *left_end,
+                    const Suffix *right, const Suffix *right_end, Gap gap) {
+        for (auto l = left; l != left_end; ++l) {
+            for (auto r = right; r != right_end; ++r) {
+                Expression e = append(*l, digits[cut], gap);
+                for (size_t i = cut + 1; i < digits.size(); ++i)
+                    e = append(e, digits[i], static_cast<Gap>(r->gaps >> (2*(i - cut - 1)) & 3));
+                output.push_back(e);
+            }
+        }
+    }
+
+    const vector<int> &digits;
+    size_t cut;
+    vector<Expression> output;
+};
+
+vector<Expression>
+mitm_solutions(const vector<int> &digits, int target_value=100)
+{
+    if (digits.size() < 2)
+        return fast_solutions(digits, target_value);
+    CollectingSink sink(digits);
+    meet_in_the_middle(digits, target_value, sink);
+    return sink.output;
+}
+
+uint64_t
+mitm_count(const vector<int> &digits, int target_value=100)
+{
+    if (digits.size() < 2)
+        return fast_solutions(digits, target_value).size();
+    CountingSink sink;
+    meet_in_the_middle(digits, target_value, sink);
+    return sink.count;
+}
+
+vector<int>
+to_digits(const string &s)
+{
+    vector<int> digits;
+    for (auto c : s)
+        digits.push_back(c - '0');
+    return digits;
+}
+
+// Runs search() with the plain value() <= target check and with
+// ExpressionBounds, counting the nodes each one lets through; false if
+// they find different solutions.
+bool
+pruning_comparison(BenchmarkRunner &bench, const string &s, int target_value,
+                   const BenchmarkOptions &options)
+{
+    auto digits = to_digits(s);
+    vector<Expression> initial;
+    initial.push_back(Expression());
+    auto g = [](const Expression & e, int digit) { return generate(e, digit); };
+    auto good = [target_value](const Expression &e) { return e.value() == target_value; };
+    string name = to_string(s.size()) + " digits, target " + to_string(target_value);
+
+    size_t plain_nodes = 0;
+    auto plain = bench.run_with_setup(name + ", value() <= target",
+            [&plain_nodes] { plain_nodes = 0; return 0; },
+            [&](int) {
+                return search(digits, initial, g, good,
+                        [target_value, &plain_nodes](const Expression &e) {
+                            bool keep = e.value() <= target_value;
+                            plain_nodes += keep;
+                            return keep;
+                        });
+            }, options);
+    cout << "  " << plain_nodes << " nodes" << endl;
+
+    size_t bounded_nodes = 0;
+    auto within = within_bounds(ExpressionBounds(digits), target_value);
+    auto bounded = bench.run_with_setup(name + ", bounds",
+            [&bounded_nodes] { bounded_nodes = 0; return 0; },
+            [&](int) {
+                return search(digits, initial, g, good,
+                        [&within, &bounded_nodes](const Expression &e) {
+                            bool keep = within(e);
+                            bounded_nodes += keep;
+                            return keep;
+                        });
+            }, options);
+    cout << "  " << bounded_nodes << " nodes" << endl;
+
+    sort(begin(plain), end(plain));
+    sort(begin(bounded), end(bounded));
+    cout << bounded.size() << " solutions"
+         << (plain == bounded ? "" : " MISMATCH") << endl;
+    return plain == bounded;
+}
+
+// Times parallel_solutions() on pools of 1, 2, 4, ... up to the number of
+// hardware threads; false if it ever disagrees with fast_solutions().
+bool
+parallel_scaling(BenchmarkRunner &bench, const string &s, int target_value,
+                 const BenchmarkOptions &options)
+{
+    auto digits = to_digits(s);
+    string name = to_string(s.size()) + " digits, target " + to_string(target_value);
+    auto expected = bench.run(name + ", serial search", [&digits, target_value] {
+            return fast_solutions(digits, target_value);
+        }, options);
+    cout << expected.size() << " solutions" << endl;
+    sort(begin(expected), end(expected));
+
+    bool same = true;
+    unsigned int max_threads = WorkStealingPool::default_size();
+    for (unsigned int n = 1; ; n = min(2*n, max_threads)) {
+        WorkStealingPool pool(n);
+        auto expressions = bench.run(BenchmarkId(name + ", parallel search", "threads", n),
+                [&pool, &digits, target_value] {
+                    return parallel_solutions(pool, digits, target_value);
+                }, options);
+        sort(begin(expressions), end(expressions));
+        if (expressions != expected) {
+            cout << "MISMATCH" << endl;
+            same = false;
+        }
+        if (n == max_threads)
+            break;
+    }
+    return same;
+}
+
 int main()
 {
+    BenchmarkRunner bench("century");
+    // Runs of a second or more are repeated fewer times.
+    BenchmarkOptions heavy(0, min(3u, bench.options().repetitions));
+    // Cleared by any check that fails, so that the exit status shows it.
+    bool ok = true;
+
     vector<int> digits;
     for (int i = 1; i < 10; ++i)
         digits.push_back(i);
 
-    duration_type dt;
-    auto expressions = benchmark([digits] {return solutions(digits);}, dt);
-    cout << "Slow solutions: "
-         << chrono::duration_cast<chrono::milliseconds>(dt).count()
-         << "ms" << endl;
+    auto expressions = bench.run("Slow solutions, 9 digits", [digits] {return solutions(digits);});
     for (const auto expr : expressions) {
         expr.pretty_print();
     }
 
-    expressions = benchmark([digits] {return fast_solutions(digits);}, dt);
-    cout << "Fast solutions: "
-         << chrono::duration_cast<chrono::milliseconds>(dt).count()
-         << "ms" << endl;
+    expressions = bench.run("Fast solutions, 9 digits", [digits] {return fast_solutions(digits);});
     for (const auto expr : expressions) {
         expr.pretty_print();
     }
 
-    auto pi_digits = "31415926535897";
-    digits.clear();
-    for (auto *c = pi_digits; *c != 0; ++c)
-        digits.push_back(*c - '0');
+    digits = to_digits("31415926535897");
 
-    expressions = benchmark([digits] {return solutions(digits, 1000);}, dt);
-    cout << "Slow solutions: "
-         << chrono::duration_cast<chrono::milliseconds>(dt).count()
-         << "ms" << endl;
+    expressions = bench.run("Slow solutions, 14 digits", [digits] {return solutions(digits, 1000);});
     cout << expressions.size() << endl;
 
-    expressions = benchmark([digits] {return fast_solutions(digits, 1000);}, dt);
-    cout << "Fast solutions: "
-         << chrono::duration_cast<chrono::milliseconds>(dt).count()
-         << "ms" << endl;
+    expressions = bench.run("Fast solutions, 14 digits", [digits] {return fast_solutions(digits, 1000);});
     cout << expressions.size() << endl;
 
-    return 0;
+    vector<pair<string, int>> checks = {{"123456789", 100}, {"31415926535897", 1000}};
+    for (const auto &check : checks) {
+        digits = to_digits(check.first);
+        int target_value = check.second;
+        auto expected = fast_solutions(digits, target_value);
+        expressions = bench.run("Meet in the middle, " + to_string(digits.size()) + " digits",
+                [&digits, target_value] { return mitm_solutions(digits, target_value); });
+        sort(begin(expected), end(expected));
+        sort(begin(expressions), end(expressions));
+        cout << expressions.size()
+             << (expressions == expected ? "" : " MISMATCH") << endl;
+        ok &= expressions == expected;
+    }
+
+    // Twenty digits ending in a 0: in front of it the bounds keep terms of
+    // up to twenty digits, beyond long long, so this relies on saturation.
+    // Every solution is checked with exact arithmetic as well.
+    digits = to_digits("31415926535897932380");
+    expressions = bench.run("Fast solutions, 20 digits with a 0",
+            [&digits] { return fast_solutions(digits, 1000); }, heavy);
+    {
+        auto expected = mitm_solutions(digits, 1000);
+        bool exact = all_of(begin(expressions), end(expressions),
+                [](const Expression &e) { return e.exact_value() == 1000; });
+        sort(begin(expected), end(expected));
+        sort(begin(expressions), end(expressions));
+        cout << expressions.size()
+             << (exact && expressions == expected ? "" : " MISMATCH") << endl;
+        ok &= exact && expressions == expected;
+    }
+
+    {
+        Expression e;
+        bool thrown = false;
+        try {
+            for (unsigned int i = 0; i <= Expression::max_digits; ++i)
+                e = e.add_term(1);
+        } catch (const length_error &) {
+            thrown = e.size() == Expression::max_digits;
+        }
+        cout << "Digit " << Expression::max_digits + 1
+             << (thrown ? " rejected" : " accepted MISMATCH") << endl;
+        ok &= thrown;
+    }
+
+    auto counts = bench.sweep("Meet in the middle, count only", "digits", vector<size_t>{25, 28, 30},
+            [](size_t n) { return to_digits(string("314159265358979323846264338327").substr(0, n)); },
+            [](const vector<int> &digits) { return mitm_count(digits, 1000); });
+    for (auto count : counts)
+        cout << count << endl;
+
+    digits = to_digits("31415926535897");
+    auto stream = solution_stream(digits, 1000);
+    vector<Expression> streamed(stream.begin(), stream.end());
+    bool same = streamed == fast_solutions(digits, 1000);
+    cout << "Streamed solutions: " << streamed.size() << (same ? "" : " MISMATCH") << endl;
+    ok &= same;
+
+    digits = to_digits("314159265358979323846264338327");
+    auto first_five = bench.run("First 5 of 30 digits, streamed", [&digits] {
+            vector<Expression> result;
+            auto stream = solution_stream(digits, 1000);
+            // Stop before advancing past the fifth, which would search on
+            // for a sixth.
+            for (auto it = stream.begin(); it != stream.end(); ++it) {
+                result.push_back(*it);
+                if (result.size() == 5)
+                    break;
+            }
+            return result;
+        });
+    for (const auto expr : first_five) {
+        expr.pretty_print();
+    }
+
+    digits = to_digits("31415926535897932384");
+    auto count = bench.run("Streamed count, 20 digits", [&digits] {
+            size_t n = 0;
+            auto stream = solution_stream(digits, 1000);
+            Expression expr;
+            while (stream.next(expr))
+                ++n;
+            return n;
+        }, heavy);
+    cout << count << endl;
+
+    ok &= pruning_comparison(bench, "123456789", 100, bench.options());
+    ok &= pruning_comparison(bench, "31415926535897", 1000, bench.options());
+    ok &= pruning_comparison(bench, "31415926535897932384", 1000, heavy);
+    ok &= pruning_comparison(bench, "31415926535897932", 100000, heavy);
+
+    ok &= parallel_scaling(bench, "31415926535897", 1000, bench.options());
+    ok &= parallel_scaling(bench, "31415926535897932", 1000, heavy);
+    ok &= parallel_scaling(bench, "31415926535897932384", 1000, heavy);
+
+    return ok ? 0 : 1;
 }
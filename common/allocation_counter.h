@@ -0,0 +1,278 @@
+#ifndef ALLOCATION_COUNTER_H
+#define ALLOCATION_COUNTER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+// Heap allocations made through the global operator new by any thread:
+// how many, how many bytes, and how far the live total rose above where
+// it stood when the region started.  Counting is opt-in: compile with
+// -DCOUNT_ALLOCATIONS and this header replaces the global operator new and
+// delete, the over-aligned forms of C++17 included, which is only valid in a program with a single translation unit
+// including it, as every pearl is.  Otherwise no sample is valid and
+// nothing is counted.  Allocators that bypass operator new, such as GMP's,
+// can report through allocated() and freed().  Regions must not overlap.
+class AllocationCounter
+{
+    public:
+        struct Sample
+        {
+            Sample() : valid(false), count(0), bytes(0), peak_bytes(0) {}
+
+            bool valid;
+            double count;
+            double bytes;
+            double peak_bytes;
+        };
+
+        static bool enabled()
+        {
+#ifdef COUNT_ALLOCATIONS
+            return true;
+#else
+            return false;
+#endif
+        }
+
+        void start()
+        {
+            State &s = state();
+            _count = s.count.load(std::memory_order_relaxed);
+            _bytes = s.bytes.load(std::memory_order_relaxed);
+            _live = s.live.load(std::memory_order_relaxed);
+            s.peak.store(_live, std::memory_order_relaxed);
+        }
+
+        Sample stop() const
+        {
+            Sample sample;
+            if (!enabled())
+                return sample;
+            State &s = state();
+            int64_t peak = s.peak.load(std::memory_order_relaxed);
+            sample.valid = true;
+            sample.count = s.count.load(std::memory_order_relaxed) - _count;
+            sample.bytes = s.bytes.load(std::memory_order_relaxed) - _bytes;
+            sample.peak_bytes = peak > _live ? peak - _live : 0;
+            return sample;
+        }
+
+        static void allocated(size_t size)
+        {
+            State &s = state();
+            s.count.fetch_add(1, std::memory_order_relaxed);
+            s.bytes.fetch_add(size, std::memory_order_relaxed);
+            int64_t live = s.live.fetch_add(size, std::memory_order_relaxed) + static_cast<int64_t>(size);
+            int64_t peak = s.peak.load(std::memory_order_relaxed);
+            while (live > peak && !s.peak.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+                ;
+        }
+
+        static void freed(size_t size)
+        {
+            state().live.fetch_sub(size, std::memory_order_relaxed);
+        }
+
+    private:
+        // Constant-initialised, so operator new may run before main().
+        struct State
+        {
+            std::atomic<uint64_t> count;
+            std::atomic<uint64_t> bytes;
+            std::atomic<int64_t> live;
+            std::atomic<int64_t> peak;
+        };
+
+        static State &state()
+        {
+            static State s = { {0}, {0}, {0}, {0} };
+            return s;
+        }
+
+        uint64_t _count = 0;
+        uint64_t _bytes = 0;
+        int64_t _live = 0;
+};
+
+#ifdef COUNT_ALLOCATIONS
+// Every block carries its requested size in front of it, so that delete
+// can subtract it from the live total.  Over-aligned blocks keep a whole
+// alignment unit in front instead, so that what new returns stays aligned.
+namespace allocation_counter_detail
+{
+    const size_t prefix = alignof(std::max_align_t);
+
+    inline void *allocate(size_t size) noexcept
+    {
+        void *block = std::malloc(size + prefix);
+        if (!block)
+            return nullptr;
+        *static_cast<size_t *>(block) = size;
+        AllocationCounter::allocated(size);
+        return static_cast<char *>(block) + prefix;
+    }
+
+#ifdef __cpp_aligned_new
+    inline size_t aligned_prefix(std::align_val_t alignment)
+    {
+        return static_cast<size_t>(alignment) > prefix ? static_cast<size_t>(alignment) : prefix;
+    }
+
+    inline void *allocate(size_t size, std::align_val_t alignment) noexcept
+    {
+        size_t offset = aligned_prefix(alignment);
+        size_t unit = static_cast<size_t>(alignment);
+        // aligned_alloc() takes only multiples of the alignment.
+        void *block = std::aligned_alloc(unit, (size + offset + unit - 1)/unit*unit);
+        if (!block)
+            return nullptr;
+        *static_cast<size_t *>(block) = size;
+        AllocationCounter::allocated(size);
+        return static_cast<char *>(block) + offset;
+    }
+
+    inline void deallocate(void *p, std::align_val_t alignment) noexcept
+    {
+        if (!p)
+            return;
+        char *block = static_cast<char *>(p) - aligned_prefix(alignment);
+        AllocationCounter::freed(*reinterpret_cast<size_t *>(block));
+        std::free(block);
+    }
+#endif
+
+    // Args is empty, or the alignment of an over-aligned new.
+    template<class... Args>
+    inline void *allocate_or_throw(size_t size, Args... alignment)
+    {
+        while (true) {
+            if (void *p = allocate(size, alignment...))
+                return p;
+            std::new_handler handler = std::get_new_handler();
+            if (!handler)
+                throw std::bad_alloc();
+            handler();
+        }
+    }
+
+    inline void deallocate(void *p) noexcept
+    {
+        if (!p)
+            return;
+        char *block = static_cast<char *>(p) - prefix;
+        AllocationCounter::freed(*reinterpret_cast<size_t *>(block));
+        std::free(block);
+    }
+}
+
+void *operator new(size_t size)
+{
+    return allocation_counter_detail::allocate_or_throw(size);
+}
+
+void *operator new[](size_t size)
+{
+    return allocation_counter_detail::allocate_or_throw(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    return allocation_counter_detail::allocate(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return allocation_counter_detail::allocate(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    allocation_counter_detail::deallocate(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    allocation_counter_detail::deallocate(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept
+{
+    allocation_counter_detail::deallocate(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept
+{
+    allocation_counter_detail::deallocate(p);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void *p, size_t) noexcept
+{
+    allocation_counter_detail::deallocate(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+    allocation_counter_detail::deallocate(p);
+}
+#endif
+
+#ifdef __cpp_aligned_new
+void *operator new(size_t size, std::align_val_t alignment)
+{
+    return allocation_counter_detail::allocate_or_throw(size, alignment);
+}
+
+void *operator new[](size_t size, std::align_val_t alignment)
+{
+    return allocation_counter_detail::allocate_or_throw(size, alignment);
+}
+
+void *operator new(size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    return allocation_counter_detail::allocate(size, alignment);
+}
+
+void *operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    return allocation_counter_detail::allocate(size, alignment);
+}
+
+void operator delete(void *p, std::align_val_t alignment) noexcept
+{
+    allocation_counter_detail::deallocate(p, alignment);
+}
+
+void operator delete[](void *p, std::align_val_t alignment) noexcept
+{
+    allocation_counter_detail::deallocate(p, alignment);
+}
+
+void operator delete(void *p, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    allocation_counter_detail::deallocate(p, alignment);
+}
+
+void operator delete[](void *p, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    allocation_counter_detail::deallocate(p, alignment);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void *p, size_t, std::align_val_t alignment) noexcept
+{
+    allocation_counter_detail::deallocate(p, alignment);
+}
+
+void operator delete[](void *p, size_t, std::align_val_t alignment) noexcept
+{
+    allocation_counter_detail::deallocate(p, alignment);
+}
+#endif
+#endif
+#endif
+
+#endif
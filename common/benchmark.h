@@ -1,20 +1,480 @@
 #ifndef BENCHMARK_H
 #define BENCHMARK_H
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
-typedef std::chrono::steady_clock::duration duration_type;
+#include "allocation_counter.h"
+#include "perf_counters.h"
 
-template<class F>
-auto benchmark(F f, duration_type &dt) -> decltype(f())
+// Keeps the compiler from dropping a benchmarked result, or the work that
+// produced it, as dead code.
+template<class T>
+inline void do_not_optimize(const T &value)
 {
-    std::chrono::steady_clock clock;
-    auto t1 = clock.now();
-    auto res = f();
-    auto t2 = clock.now();
-    dt = t2 - t1;
-    return res;
+    asm volatile("" : : "r,m"(value) : "memory");
 }
 
+struct BenchmarkOptions
+{
+    explicit BenchmarkOptions(unsigned int warmup=1, unsigned int repetitions=5) :
+        warmup(warmup),
+        repetitions(repetitions == 0 ? 1 : repetitions)
+    {
+    }
+
+    // BENCHMARK_WARMUP and BENCHMARK_REPETITIONS override the defaults.
+    static BenchmarkOptions from_environment(BenchmarkOptions defaults=BenchmarkOptions())
+    {
+        if (const char *warmup = std::getenv("BENCHMARK_WARMUP"))
+            defaults.warmup = std::strtoul(warmup, nullptr, 10);
+        if (const char *repetitions = std::getenv("BENCHMARK_REPETITIONS"))
+            defaults.repetitions = std::max(1ul, std::strtoul(repetitions, nullptr, 10));
+        return defaults;
+    }
+
+    unsigned int warmup;
+    unsigned int repetitions;
+};
+
+// What is being measured: a name, and for the runs of a sweep the
+// parameter and its value.
+struct BenchmarkId
+{
+    BenchmarkId(const char *name) : name(name), value(0) {}
+    BenchmarkId(const std::string &name) : name(name), value(0) {}
+    BenchmarkId(const std::string &name, const std::string &parameter, long long value) :
+        name(name), parameter(parameter), value(value) {}
+
+    std::string name;
+    std::string parameter;
+    long long value;
+};
+
+struct BenchmarkResult
+{
+    BenchmarkId id;
+    unsigned int warmup;
+    unsigned int repetitions;
+    double min_ns;
+    double median_ns;
+    double p95_ns;
+    double mean_ns;
+    double stddev_ns;
+    // Mean per timed run; events without counters are not valid.
+    PerfCounters::Sample counters;
+    // Mean count and bytes per timed run and the largest peak, when built
+    // with COUNT_ALLOCATIONS.
+    AllocationCounter::Sample allocations;
+};
+
+// Runs every benchmark warmup + repetitions times, printing a summary line
+// as it goes and keeping the statistics.  The setup of a run is not timed,
+// so code that consumes its input gets a fresh copy every time.  When
+// BENCHMARK_FORMAT is "json" or "csv" all results are written in that
+// format when the runner is destroyed, to BENCHMARK_OUTPUT if set and to
+// standard output otherwise; other formats are rejected.  So that standard
+// output then holds nothing but the report, std::cout is sent to standard
+// error for the runner's lifetime, with the summaries and whatever else the
+// program prints.  Hardware counters are read around every
+// timed run where perf events are available, unless BENCHMARK_COUNTERS is
+// "0", and so are heap allocations in a build with COUNT_ALLOCATIONS.
+class BenchmarkRunner
+{
+    public:
+        explicit BenchmarkRunner(const std::string &suite,
+                                 BenchmarkOptions options=BenchmarkOptions::from_environment()) :
+            _suite(suite),
+            _options(options),
+            _stdout(nullptr)
+        {
+            if (const char *format = std::getenv("BENCHMARK_FORMAT"))
+                _format = format;
+            if (!_format.empty() && _format != "json" && _format != "csv")
+                throw std::invalid_argument("BENCHMARK_FORMAT must be json or csv, not " + _format);
+            if (const char *output = std::getenv("BENCHMARK_OUTPUT"))
+                _output = output;
+            if (!_format.empty() && _output.empty())
+                _stdout = std::cout.rdbuf(std::cerr.rdbuf());
+            const char *counters = std::getenv("BENCHMARK_COUNTERS");
+            if (!counters || std::string(counters) != "0") {
+                _counters.reset(new PerfCounters);
+                if (!_counters->available())
+                    _counters.reset();
+            }
+        }
+
+        ~BenchmarkRunner()
+        {
+            if (_format.empty())
+                return;
+            if (_stdout) {
+                std::cout.flush();
+                std::cout.rdbuf(_stdout);
+                write_report(std::cout);
+            } else {
+                std::ofstream out(_output);
+                write_report(out);
+            }
+        }
+
+        BenchmarkRunner(const BenchmarkRunner &) = delete;
+        BenchmarkRunner &operator=(const BenchmarkRunner &) = delete;
+
+        const BenchmarkOptions &options() const
+        {
+            return _options;
+        }
+
+        // f() must return its result, which is passed through
+        // do_not_optimize(); the result of the last run is returned.
+        template<class F>
+        auto run(const BenchmarkId &id, F f) -> decltype(f())
+        {
+            return run(id, f, _options);
+        }
+
+        template<class F>
+        auto run(const BenchmarkId &id, F f, const BenchmarkOptions &options) -> decltype(f())
+        {
+            return run_with_setup(id, [] { return 0; }, [&f](int) { return f(); }, options);
+        }
+
+        // Calls f(input) on a fresh input = setup() for every run.
+        template<class Setup, class F>
+        auto run_with_setup(const BenchmarkId &id, Setup setup, F f)
+            -> decltype(f(std::declval<typename std::result_of<Setup()>::type &>()))
+        {
+            return run_with_setup(id, setup, f, _options);
+        }
+
+        template<class Setup, class F>
+        auto run_with_setup(const BenchmarkId &id, Setup setup, F f, const BenchmarkOptions &options)
+            -> decltype(f(std::declval<typename std::result_of<Setup()>::type &>()))
+        {
+            typedef std::chrono::steady_clock clock;
+
+            for (unsigned int i = 0; i < options.warmup; ++i) {
+                auto input = setup();
+                do_not_optimize(f(input));
+            }
+
+            std::vector<double> times;
+            std::vector<PerfCounters::Sample> samples;
+            std::vector<AllocationCounter::Sample> allocations;
+            times.reserve(options.repetitions);
+            samples.reserve(options.repetitions);
+            allocations.reserve(options.repetitions);
+            for (unsigned int i = 1; i < options.repetitions; ++i) {
+                auto input = setup();
+                start_counters();
+                auto t1 = clock::now();
+                do_not_optimize(f(input));
+                auto t2 = clock::now();
+                stop_counters(samples, allocations);
+                times.push_back(std::chrono::duration<double, std::nano>(t2 - t1).count());
+            }
+            auto input = setup();
+            start_counters();
+            auto t1 = clock::now();
+            auto result = f(input);
+            do_not_optimize(result);
+            auto t2 = clock::now();
+            stop_counters(samples, allocations);
+            times.push_back(std::chrono::duration<double, std::nano>(t2 - t1).count());
+
+            record(id, options, times, samples, allocations);
+            return result;
+        }
+
+        // One run per parameter value, on input = setup(value); returns the
+        // result for every value.
+        template<class Value, class Setup, class F>
+        auto sweep(const std::string &name, const std::string &parameter,
+                   const std::vector<Value> &values, Setup setup, F f)
+            -> std::vector<decltype(f(std::declval<typename std::result_of<Setup(Value)>::type &>()))>
+        {
+            std::vector<decltype(f(std::declval<typename std::result_of<Setup(Value)>::type &>()))> results;
+            for (auto value : values) {
+                results.push_back(run_with_setup(BenchmarkId(name, parameter, value),
+                                                 [&setup, value] { return setup(value); }, f));
+            }
+            return results;
+        }
+
+        const std::vector<BenchmarkResult> &results() const
+        {
+            return _results;
+        }
+
+        const BenchmarkResult &last() const
+        {
+            return _results.back();
+        }
+
+        // A duration in ns with three significant digits and a unit.
+        static std::string format_duration(double ns)
+        {
+            const char *units[] = {"ns", "us", "ms", "s"};
+            unsigned int unit = 0;
+            while (unit < 3 && ns >= 1000) {
+                ns /= 1000;
+                ++unit;
+            }
+            std::ostringstream out;
+            out << std::setprecision(3) << ns << units[unit];
+            return out.str();
+        }
+
+        // A count with three significant digits and an SI suffix.
+        static std::string format_count(double n)
+        {
+            const char *suffixes[] = {"", "k", "M", "G", "T"};
+            unsigned int suffix = 0;
+            while (suffix < 4 && n >= 1000) {
+                n /= 1000;
+                ++suffix;
+            }
+            std::ostringstream out;
+            out << std::setprecision(3) << n << suffixes[suffix];
+            return out.str();
+        }
+
+    private:
+        void start_counters()
+        {
+            if (_counters)
+                _counters->start();
+            _allocations.start();
+        }
+
+        // The vectors have room for every run, so pushing onto them does
+        // not allocate.
+        void stop_counters(std::vector<PerfCounters::Sample> &samples,
+                           std::vector<AllocationCounter::Sample> &allocations)
+        {
+            allocations.push_back(_allocations.stop());
+            if (_counters)
+                samples.push_back(_counters->stop());
+        }
+
+        static PerfCounters::Sample mean(const std::vector<PerfCounters::Sample> &samples)
+        {
+            PerfCounters::Sample result;
+            for (unsigned int e = 0; e < PerfCounters::n_events; ++e) {
+                unsigned int n = 0;
+                for (const auto &sample : samples) {
+                    if (sample.valid[e]) {
+                        result.values[e] += sample.values[e];
+                        ++n;
+                    }
+                }
+                result.valid[e] = n > 0;
+                if (n > 0)
+                    result.values[e] /= n;
+            }
+            return result;
+        }
+
+        static AllocationCounter::Sample summarize(const std::vector<AllocationCounter::Sample> &samples)
+        {
+            AllocationCounter::Sample result;
+            for (const auto &sample : samples) {
+                if (!sample.valid)
+                    continue;
+                result.valid = true;
+                result.count += sample.count/samples.size();
+                result.bytes += sample.bytes/samples.size();
+                result.peak_bytes = std::max(result.peak_bytes, sample.peak_bytes);
+            }
+            return result;
+        }
+
+        static void print_allocations(const AllocationCounter::Sample &allocations)
+        {
+            if (!allocations.valid)
+                return;
+            std::cout << "  " << format_count(allocations.count) << " allocations, "
+                      << format_count(allocations.bytes) << "B allocated, "
+                      << format_count(allocations.peak_bytes) << "B peak live" << std::endl;
+        }
+
+        static void print_counters(const PerfCounters::Sample &counters)
+        {
+            std::string line;
+            for (unsigned int e = 0; e < PerfCounters::n_events; ++e) {
+                if (!counters.valid[e])
+                    continue;
+                line += line.empty() ? "  " : ", ";
+                line += format_count(counters.values[e]) + " " +
+                    PerfCounters::name(static_cast<PerfCounters::Event>(e));
+                if (e == PerfCounters::instructions && counters.valid[PerfCounters::cycles] &&
+                        counters.values[PerfCounters::cycles] > 0) {
+                    std::ostringstream ipc;
+                    ipc << std::setprecision(3)
+                        << counters.values[e]/counters.values[PerfCounters::cycles];
+                    line += " (IPC " + ipc.str() + ")";
+                }
+            }
+            if (!line.empty())
+                std::cout << line << std::endl;
+        }
+
+        void record(const BenchmarkId &id, const BenchmarkOptions &options, std::vector<double> times,
+                    const std::vector<PerfCounters::Sample> &samples,
+                    const std::vector<AllocationCounter::Sample> &allocations)
+        {
+            std::sort(times.begin(), times.end());
+            size_t n = times.size();
+
+            BenchmarkResult r = { id, options.warmup, options.repetitions, 0, 0, 0, 0, 0, mean(samples),
+                                  summarize(allocations) };
+            r.min_ns = times.front();
+            r.median_ns = n % 2 ? times[n/2] : (times[n/2 - 1] + times[n/2])/2;
+            r.p95_ns = times[static_cast<size_t>(std::ceil(0.95*n)) - 1];
+            double sum = 0;
+            for (auto t : times)
+                sum += t;
+            r.mean_ns = sum/n;
+            double squares = 0;
+            for (auto t : times)
+                squares += (t - r.mean_ns)*(t - r.mean_ns);
+            r.stddev_ns = n > 1 ? std::sqrt(squares/(n - 1)) : 0;
+            _results.push_back(r);
+
+            std::cout << label(id) << ": " << format_duration(r.median_ns);
+            if (n > 1) {
+                std::cout << " median (min " << format_duration(r.min_ns)
+                          << ", p95 " << format_duration(r.p95_ns)
+                          << ", sd " << format_duration(r.stddev_ns)
+                          << ", " << n << " runs)";
+            }
+            std::cout << std::endl;
+            print_counters(r.counters);
+            print_allocations(r.allocations);
+        }
+
+        static std::string label(const BenchmarkId &id)
+        {
+            if (id.parameter.empty())
+                return id.name;
+            std::ostringstream out;
+            out << id.name << " [" << id.parameter << "=" << id.value << "]";
+            return out.str();
+        }
+
+        static std::string json_string(const std::string &s)
+        {
+            std::string quoted = "\"";
+            for (auto c : s) {
+                if (c == '"' || c == '\\')
+                    quoted += '\\';
+                quoted += c;
+            }
+            return quoted + "\"";
+        }
+
+        static std::string csv_field(const std::string &s)
+        {
+            if (s.find_first_of(",\"\n") == std::string::npos)
+                return s;
+            std::string quoted = "\"";
+            for (auto c : s) {
+                if (c == '"')
+                    quoted += '"';
+                quoted += c;
+            }
+            return quoted + "\"";
+        }
+
+        void write_report(std::ostream &out) const
+        {
+            out << std::setprecision(15);
+            if (_format == "csv") {
+                out << "suite,name,parameter,value,warmup,repetitions,"
+                    << "min_ns,median_ns,p95_ns,mean_ns,stddev_ns";
+                for (unsigned int e = 0; e < PerfCounters::n_events; ++e)
+                    out << "," << PerfCounters::name(static_cast<PerfCounters::Event>(e));
+                out << ",allocations,allocated_bytes,peak_live_bytes" << std::endl;
+                for (const auto &r : _results) {
+                    out << csv_field(_suite) << "," << csv_field(r.id.name) << ","
+                        << csv_field(r.id.parameter) << ",";
+                    if (!r.id.parameter.empty())
+                        out << r.id.value;
+                    out << "," << r.warmup << "," << r.repetitions << ","
+                        << r.min_ns << "," << r.median_ns << "," << r.p95_ns << ","
+                        << r.mean_ns << "," << r.stddev_ns;
+                    for (unsigned int e = 0; e < PerfCounters::n_events; ++e) {
+                        out << ",";
+                        if (r.counters.valid[e])
+                            out << r.counters.values[e];
+                    }
+                    if (r.allocations.valid)
+                        out << "," << r.allocations.count << "," << r.allocations.bytes
+                            << "," << r.allocations.peak_bytes;
+                    else
+                        out << ",,,";
+                    out << std::endl;
+                }
+                return;
+            }
+
+            out << "{\"suite\": " << json_string(_suite) << ", \"results\": [";
+            for (size_t i = 0; i < _results.size(); ++i) {
+                const auto &r = _results[i];
+                out << (i == 0 ? "\n" : ",\n")
+                    << "  {\"name\": " << json_string(r.id.name);
+                if (!r.id.parameter.empty())
+                    out << ", \"parameter\": " << json_string(r.id.parameter)
+                        << ", \"value\": " << r.id.value;
+                out << ", \"warmup\": " << r.warmup
+                    << ", \"repetitions\": " << r.repetitions
+                    << ", \"min_ns\": " << r.min_ns
+                    << ", \"median_ns\": " << r.median_ns
+                    << ", \"p95_ns\": " << r.p95_ns
+                    << ", \"mean_ns\": " << r.mean_ns
+                    << ", \"stddev_ns\": " << r.stddev_ns;
+                bool first = true;
+                for (unsigned int e = 0; e < PerfCounters::n_events; ++e) {
+                    if (!r.counters.valid[e])
+                        continue;
+                    out << (first ? ", \"counters\": {" : ", ")
+                        << json_string(PerfCounters::name(static_cast<PerfCounters::Event>(e)))
+                        << ": " << r.counters.values[e];
+                    first = false;
+                }
+                if (!first)
+                    out << "}";
+                if (r.allocations.valid)
+                    out << ", \"allocations\": {\"count\": " << r.allocations.count
+                        << ", \"bytes\": " << r.allocations.bytes
+                        << ", \"peak_live_bytes\": " << r.allocations.peak_bytes << "}";
+                out << "}";
+            }
+            out << "\n]}" << std::endl;
+        }
+
+        std::string _suite;
+        BenchmarkOptions _options;
+        std::string _format;
+        std::string _output;
+        // The buffer of standard output while std::cout is redirected.
+        std::streambuf *_stdout;
+        std::vector<BenchmarkResult> _results;
+        std::unique_ptr<PerfCounters> _counters;
+        AllocationCounter _allocations;
+};
 
 #endif
@@ -0,0 +1,228 @@
+#ifndef MAPPED_SEQUENCE_H
+#define MAPPED_SEQUENCE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// The header of a cached sequence file.  The elements follow it directly,
+// in host byte order; the byte order mark rejects files from a machine of
+// the other endianness.  Bump version whenever the layout or the way
+// SequenceGenerator produces a sequence changes.
+struct SequenceHeader
+{
+    static const uint32_t current_version = 1;
+    static const uint32_t byte_order_mark = 0x01020304u;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t type;
+    uint32_t unique;
+    uint64_t size;
+    uint64_t seed;
+    uint64_t min;
+    uint64_t max;
+    uint64_t reserved;
+
+    template<class T>
+    static SequenceHeader make(T min, T max, uint64_t size, uint64_t seed, bool unique)
+    {
+        static_assert(std::is_arithmetic<T>::value && sizeof(T) <= sizeof(uint64_t),
+                      "only fixed-width arithmetic types can be cached");
+        SequenceHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, "FPSEQ\0\0", sizeof(header.magic));
+        header.version = current_version;
+        header.byte_order = byte_order_mark;
+        header.type = type_code<T>();
+        header.unique = unique;
+        header.size = size;
+        header.seed = seed;
+        std::memcpy(&header.min, &min, sizeof(T));
+        std::memcpy(&header.max, &max, sizeof(T));
+        return header;
+    }
+
+    // 'f', 's' or 'u' in the high byte, the element size in the low one.
+    template<class T>
+    static uint32_t type_code()
+    {
+        uint32_t kind = std::is_floating_point<T>::value ? 'f' : std::is_signed<T>::value ? 's' : 'u';
+        return kind << 8 | sizeof(T);
+    }
+
+    bool operator==(const SequenceHeader &other) const
+    {
+        return std::memcmp(this, &other, sizeof(SequenceHeader)) == 0;
+    }
+
+    // A file name that spells out the whole key, so that different
+    // sequences never share a file.
+    std::string file_name() const
+    {
+        char name[128];
+        std::snprintf(name, sizeof(name), "seq_%c%u_%016llx_%016llx_%llu_%llu%s.bin",
+                      static_cast<char>(type >> 8), type & 0xff,
+                      static_cast<unsigned long long>(min), static_cast<unsigned long long>(max),
+                      static_cast<unsigned long long>(size), static_cast<unsigned long long>(seed),
+                      unique ? "_unique" : "");
+        return name;
+    }
+};
+
+static_assert(sizeof(SequenceHeader) == 64, "the elements should start 64 bytes into the file");
+
+// A read-only, contiguous view of a sequence: either a cache file mapped
+// into memory, with the elements used in place, or a vector it owns when
+// no mapping could be made.  Move-only; unmaps on destruction.
+template<class T>
+class MappedSequence
+{
+    public:
+        typedef T value_type;
+        typedef const T *const_iterator;
+        typedef const T *iterator;
+
+        MappedSequence() : _mapping(nullptr), _mapping_size(0), _data(nullptr), _size(0) {}
+
+        explicit MappedSequence(std::vector<T> values) :
+            _mapping(nullptr),
+            _mapping_size(0),
+            _owned(std::move(values)),
+            _data(_owned.data()),
+            _size(_owned.size())
+        {
+        }
+
+        MappedSequence(MappedSequence &&other) : MappedSequence()
+        {
+            swap(other);
+        }
+
+        MappedSequence &operator=(MappedSequence &&other)
+        {
+            MappedSequence(std::move(other)).swap(*this);
+            return *this;
+        }
+
+        MappedSequence(const MappedSequence &) = delete;
+        MappedSequence &operator=(const MappedSequence &) = delete;
+
+        ~MappedSequence()
+        {
+#if defined(__unix__) || defined(__APPLE__)
+            if (_mapping)
+                munmap(_mapping, _mapping_size);
+#endif
+        }
+
+        // Maps path if it holds exactly the sequence described by header;
+        // returns an empty, unmapped sequence otherwise.
+        static MappedSequence load(const std::string &path, const SequenceHeader &header)
+        {
+            MappedSequence result;
+#if defined(__unix__) || defined(__APPLE__)
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                return result;
+            struct stat st;
+            size_t expected = sizeof(SequenceHeader) + header.size*sizeof(T);
+            if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) != expected) {
+                close(fd);
+                return result;
+            }
+            void *mapping = mmap(nullptr, expected, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (mapping == MAP_FAILED)
+                return result;
+            if (!(*static_cast<const SequenceHeader *>(mapping) == header)) {
+                munmap(mapping, expected);
+                return result;
+            }
+            result._mapping = mapping;
+            result._mapping_size = expected;
+            result._data = reinterpret_cast<const T *>(static_cast<const char *>(mapping) + sizeof(SequenceHeader));
+            result._size = header.size;
+#else
+            (void)path;
+            (void)header;
+#endif
+            return result;
+        }
+
+        // Writes header and values to a temporary file that is then renamed
+        // to path, so that a concurrent load() never sees a partial file.
+        static bool save(const std::string &path, const SequenceHeader &header, const std::vector<T> &values)
+        {
+            std::string temporary = path + ".tmp" + std::to_string(process_id());
+            {
+                std::ofstream out(temporary, std::ios::binary);
+                out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+                out.write(reinterpret_cast<const char *>(values.data()), values.size()*sizeof(T));
+                if (!out) {
+                    out.close();
+                    std::remove(temporary.c_str());
+                    return false;
+                }
+            }
+            if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+                std::remove(temporary.c_str());
+                return false;
+            }
+            return true;
+        }
+
+        bool mapped() const { return _mapping != nullptr; }
+
+        const T *data() const { return _data; }
+        size_t size() const { return _size; }
+        bool empty() const { return _size == 0; }
+        const T *begin() const { return _data; }
+        const T *end() const { return _data + _size; }
+        const T &operator[](size_t i) const { return _data[i]; }
+
+        std::vector<T> to_vector() const
+        {
+            return std::vector<T>(begin(), end());
+        }
+
+        void swap(MappedSequence &other)
+        {
+            std::swap(_mapping, other._mapping);
+            std::swap(_mapping_size, other._mapping_size);
+            _owned.swap(other._owned);
+            std::swap(_data, other._data);
+            std::swap(_size, other._size);
+        }
+
+    private:
+        static long process_id()
+        {
+#if defined(__unix__) || defined(__APPLE__)
+            return static_cast<long>(getpid());
+#else
+            return 0;
+#endif
+        }
+
+        void *_mapping;
+        size_t _mapping_size;
+        std::vector<T> _owned;
+        const T *_data;
+        size_t _size;
+};
+
+#endif
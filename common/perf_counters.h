@@ -0,0 +1,149 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <cstdint>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware counters of the calling thread, and of threads it starts while
+// they are open, read through perf_event_open().  Every event is opened on
+// its own, so an event the machine or container does not offer is just
+// missing from the sample; without perf support at all none are valid.
+// When the kernel multiplexes the counters, values are scaled up to the
+// time the region ran.
+class PerfCounters
+{
+    public:
+        enum Event { cycles, instructions, branch_misses, l1d_misses, llc_misses, n_events };
+
+        struct Sample
+        {
+            Sample()
+            {
+                for (unsigned int i = 0; i < n_events; ++i) {
+                    valid[i] = false;
+                    values[i] = 0;
+                }
+            }
+
+            bool valid[n_events];
+            double values[n_events];
+        };
+
+        PerfCounters()
+        {
+            for (unsigned int i = 0; i < n_events; ++i)
+                _fds[i] = open_event(static_cast<Event>(i));
+        }
+
+        ~PerfCounters()
+        {
+#ifdef __linux__
+            for (unsigned int i = 0; i < n_events; ++i) {
+                if (_fds[i] >= 0)
+                    close(_fds[i]);
+            }
+#endif
+        }
+
+        PerfCounters(const PerfCounters &) = delete;
+        PerfCounters &operator=(const PerfCounters &) = delete;
+
+        bool available() const
+        {
+            for (unsigned int i = 0; i < n_events; ++i) {
+                if (_fds[i] >= 0)
+                    return true;
+            }
+            return false;
+        }
+
+        void start()
+        {
+#ifdef __linux__
+            for (unsigned int i = 0; i < n_events; ++i) {
+                if (_fds[i] >= 0) {
+                    ioctl(_fds[i], PERF_EVENT_IOC_RESET, 0);
+                    ioctl(_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+                }
+            }
+#endif
+        }
+
+        Sample stop()
+        {
+            Sample sample;
+#ifdef __linux__
+            for (unsigned int i = 0; i < n_events; ++i) {
+                if (_fds[i] >= 0)
+                    ioctl(_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            }
+            for (unsigned int i = 0; i < n_events; ++i) {
+                uint64_t data[3];
+                if (_fds[i] < 0 || read(_fds[i], data, sizeof(data)) != sizeof(data) || data[2] == 0)
+                    continue;
+                sample.valid[i] = true;
+                sample.values[i] = static_cast<double>(data[0])*data[1]/data[2];
+            }
+#endif
+            return sample;
+        }
+
+        static const char *name(Event e)
+        {
+            static const char *names[] = {
+                "cycles", "instructions", "branch_misses", "l1d_misses", "llc_misses"
+            };
+            return names[e];
+        }
+
+    private:
+        static int open_event(Event e)
+        {
+#ifdef __linux__
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            switch (e) {
+                case cycles:
+                    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+                    break;
+                case instructions:
+                    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+                    break;
+                case branch_misses:
+                    attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+                    break;
+                case l1d_misses:
+                    attr.type = PERF_TYPE_HW_CACHE;
+                    attr.config = PERF_COUNT_HW_CACHE_L1D |
+                        PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                        PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+                    break;
+                default:
+                    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+                    break;
+            }
+            attr.disabled = 1;
+            attr.inherit = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#else
+            (void)e;
+            return -1;
+#endif
+        }
+
+        int _fds[n_events];
+};
+
+#endif
@@ -1,38 +1,218 @@
 #ifndef SEQUENCE_GENERATOR_H
 #define SEQUENCE_GENERATOR_H
 
-#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
 #include <random>
-#include <unordered_set>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
+#include "mapped_sequence.h"
+#include "thread_pool.h"
+
+// Draws sequences from [min, max] (or [min, max) for floating point types),
+// without repeats when unique is set.
+//
+// generate(n) continues one mt19937 stream.  Unique values come from a
+// partial Fisher-Yates shuffle of the range when it is at most twice n, and
+// otherwise from drawing the missing count, sorting and dropping repeats
+// until n distinct values are left, which are then shuffled.
+//
+// generate(n, pool) is counter-based: element i of the stream is a hash of
+// the seed and i, so every thread computes its own block and the output
+// only depends on the seed and the position in the stream, not on the
+// number of threads.  In unique mode element i is instead the image of i
+// under a keyed permutation of the range, which needs no bookkeeping at all.
+//
+// cached(n) is what generate(n) returns on a fresh generator, kept in a
+// file under $SEQUENCE_CACHE_DIR (default: the working directory) after the
+// first run and mapped from there on later ones.
 template<typename T, bool unique=false>
 class SequenceGenerator
 {
     public:
         SequenceGenerator(T min, T max, unsigned int seed=3738u) :
             _state(seed),
-            _distribution(min, max)
+            _distribution(min, max),
+            _min(min),
+            _max(max),
+            _seed(seed),
+            _key(mix(seed)),
+            _counter(0)
         {
         }
 
         std::vector<T> generate(unsigned int n)
         {
-            std::vector<T> result;
-            std::unordered_set<T> selected;
+            if (!unique) {
+                std::vector<T> result(n);
+                for (auto &v : result)
+                    v = _distribution(_state);
+                return result;
+            }
+            return generate_unique(n, std::is_integral<T>());
+        }
 
-            while (result.size() < n) {
-                T tmp = _distribution(_state);
-                if (unique && selected.find(tmp) != selected.end())
-                    continue;
-                if (unique)
-                    selected.insert(tmp);
-                result.push_back(tmp);
+        std::vector<T> generate(unsigned int n, ThreadPool &pool)
+        {
+            static_assert(!unique || std::is_integral<T>::value,
+                          "the counter-based unique mode is only defined for integral types");
+            if (unique) {
+                uint64_t size = range_size();
+                if (size != 0 && (n > size || _counter > size - n))
+                    throw std::invalid_argument("SequenceGenerator::generate(): range exhausted");
             }
 
+            std::vector<T> result(n);
+            unsigned int n_blocks = std::min<unsigned int>(n, 4*pool.size());
+            uint64_t first = _counter;
+            pool.parallel_for(n_blocks, [&](unsigned int block) {
+                    size_t begin = static_cast<uint64_t>(n)*block/n_blocks;
+                    size_t end = static_cast<uint64_t>(n)*(block + 1)/n_blocks;
+                    for (size_t i = begin; i < end; ++i)
+                        result[i] = at(first + i);
+                });
+            _counter += n;
             return result;
         }
 
+        MappedSequence<T> cached(unsigned int n, const std::string &directory=cache_directory()) const
+        {
+            SequenceHeader header = SequenceHeader::make(_min, _max, n, _seed, unique);
+            std::string path = directory + "/" + header.file_name();
+            MappedSequence<T> result = MappedSequence<T>::load(path, header);
+            if (result.mapped())
+                return result;
+
+            auto values = SequenceGenerator(_min, _max, _seed).generate(n);
+            if (MappedSequence<T>::save(path, header, values)) {
+                result = MappedSequence<T>::load(path, header);
+                if (result.mapped())
+                    return result;
+            }
+            return MappedSequence<T>(std::move(values));
+        }
+
+        static std::string cache_directory()
+        {
+            const char *directory = std::getenv("SEQUENCE_CACHE_DIR");
+            return directory && *directory ? directory : ".";
+        }
+
     private:
+        std::vector<T> generate_unique(unsigned int n, std::true_type)
+        {
+            uint64_t size = range_size();
+            if (size != 0 && n > size)
+                throw std::invalid_argument("SequenceGenerator::generate(): range too small");
+            if (size == 0 || size/2 > n)
+                return generate_sparse(n);
+
+            std::vector<T> range(size);
+            for (uint64_t i = 0; i < size; ++i)
+                range[i] = static_cast<T>(_min + static_cast<T>(i));
+            for (unsigned int i = 0; i < n; ++i) {
+                std::uniform_int_distribution<uint64_t> pick(i, size - 1);
+                std::swap(range[i], range[pick(_state)]);
+            }
+            range.resize(n);
+            return range;
+        }
+
+        std::vector<T> generate_unique(unsigned int n, std::false_type)
+        {
+            return generate_sparse(n);
+        }
+
+        std::vector<T> generate_sparse(unsigned int n)
+        {
+            std::vector<T> result;
+            result.reserve(n);
+            while (result.size() < n) {
+                size_t old_size = result.size();
+                for (size_t i = old_size; i < n; ++i)
+                    result.push_back(_distribution(_state));
+                std::sort(result.begin() + old_size, result.end());
+                std::inplace_merge(result.begin(), result.begin() + old_size, result.end());
+                result.erase(std::unique(result.begin(), result.end()), result.end());
+            }
+            std::shuffle(result.begin(), result.end(), _state);
+            return result;
+        }
+
+        // max - min + 1 for integral types, 0 when that is 2^64.
+        uint64_t range_size() const
+        {
+            return static_cast<uint64_t>(_max) - static_cast<uint64_t>(_min) + 1;
+        }
+
+        // The splitmix64 finaliser.
+        static uint64_t mix(uint64_t z)
+        {
+            z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27))*0x94d049bb133111ebull;
+            return z ^ (z >> 31);
+        }
+
+        uint64_t random_word(uint64_t i) const
+        {
+            return mix(_key + (i + 1)*0x9e3779b97f4a7c15ull);
+        }
+
+        T at(uint64_t i) const
+        {
+            return value_at(i, std::integral_constant<bool, std::is_integral<T>::value && unique>(),
+                            std::is_integral<T>());
+        }
+
+        T value_at(uint64_t i, std::true_type, std::true_type) const
+        {
+            return static_cast<T>(static_cast<uint64_t>(_min) + permute(i));
+        }
+
+        T value_at(uint64_t i, std::false_type, std::true_type) const
+        {
+            uint64_t size = range_size();
+            uint64_t word = random_word(i);
+            uint64_t offset = size == 0 ? word :
+                static_cast<uint64_t>((static_cast<unsigned __int128>(word)*size) >> 64);
+            return static_cast<T>(static_cast<uint64_t>(_min) + offset);
+        }
+
+        T value_at(uint64_t i, std::false_type, std::false_type) const
+        {
+            double u = (random_word(i) >> 11)/9007199254740992.0;
+            return static_cast<T>(_min + (_max - _min)*u);
+        }
+
+        // A keyed bijection of [0, range_size()): a balanced Feistel network
+        // on the smallest even number of bits covering the range, applied
+        // again while the result falls outside it.
+        uint64_t permute(uint64_t i) const
+        {
+            uint64_t size = range_size();
+            unsigned int bits = 2;
+            while (bits < 64 && (size == 0 || (uint64_t(1) << bits) < size))
+                bits += 2;
+            unsigned int half = bits/2;
+            uint64_t mask = (uint64_t(1) << half) - 1;
+
+            do {
+                uint64_t left = i >> half, right = i & mask;
+                for (unsigned int round = 0; round < 4; ++round) {
+                    uint64_t next = left ^ (mix(_key ^ (right + (uint64_t(round) << 58))) & mask);
+                    left = right;
+                    right = next;
+                }
+                i = left << half | right;
+            } while (size != 0 && i >= size);
+            return i;
+        }
+
         std::mt19937 _state;
 
         template<class U, bool is_int, bool is_float>
@@ -47,6 +227,12 @@ class SequenceGenerator
             };
         typename distribution_type<T, std::is_integral<T>::value,
             std::is_floating_point<T>::value>::type _distribution;
+
+        T _min;
+        T _max;
+        unsigned int _seed;
+        uint64_t _key;
+        uint64_t _counter;
 };
 
 #endif
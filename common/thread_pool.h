@@ -0,0 +1,101 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+    public:
+        explicit ThreadPool(unsigned int n_threads=default_size()) :
+            _stop(false)
+        {
+            if (n_threads == 0)
+                n_threads = 1;
+            for (unsigned int i = 0; i < n_threads; ++i)
+                _workers.emplace_back([this] { worker_loop(); });
+        }
+
+        ~ThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stop = true;
+            }
+            _wakeup.notify_all();
+            for (auto &worker : _workers)
+                worker.join();
+        }
+
+        ThreadPool(const ThreadPool &) = delete;
+        ThreadPool &operator=(const ThreadPool &) = delete;
+
+        unsigned int size() const
+        {
+            return _workers.size();
+        }
+
+        template<class F>
+        auto submit(F f) -> std::future<decltype(f())>
+        {
+            typedef decltype(f()) result_type;
+            auto task = std::make_shared<std::packaged_task<result_type()>>(f);
+            auto result = task->get_future();
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _tasks.push([task] { (*task)(); });
+            }
+            _wakeup.notify_one();
+            return result;
+        }
+
+        // Calls f(i) for every i in [0, n) and waits for all of them.
+        // Must not be called from inside one of the pool's own tasks.
+        template<class F>
+        void parallel_for(unsigned int n, F f)
+        {
+            std::vector<std::future<void>> pending;
+            pending.reserve(n);
+            for (unsigned int i = 0; i < n; ++i)
+                pending.push_back(submit([&f, i] { f(i); }));
+            for (auto &p : pending)
+                p.get();
+        }
+
+        static unsigned int default_size()
+        {
+            unsigned int n = std::thread::hardware_concurrency();
+            return n == 0 ? 1 : n;
+        }
+
+    private:
+        void worker_loop()
+        {
+            while (true) {
+                std::function<void()> task;
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    _wakeup.wait(lock, [this] { return _stop || !_tasks.empty(); });
+                    if (_stop && _tasks.empty())
+                        return;
+                    task = std::move(_tasks.front());
+                    _tasks.pop();
+                }
+                task();
+            }
+        }
+
+        std::vector<std::thread> _workers;
+        std::queue<std::function<void()>> _tasks;
+        std::mutex _mutex;
+        std::condition_variable _wakeup;
+        bool _stop;
+};
+
+#endif
@@ -0,0 +1,250 @@
+#ifndef WORK_STEALING_POOL_H
+#define WORK_STEALING_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fork-join pool: every worker keeps its own deque, runs its newest task
+// first and steals the oldest task of another worker when it runs dry.
+// A thread waiting for a TaskGroup keeps running tasks meanwhile, so tasks
+// may spawn and wait for subtasks without tying up workers, and sleeps
+// when there is nothing to run.  The first exception a task of a group
+// throws is rethrown by wait() once all of the group's tasks are done.
+class WorkStealingPool
+{
+    public:
+        // Tasks usually refer to locals of the function that spawns them, so
+        // a group that goes out of scope without wait(), for instance when
+        // an exception unwinds the stack, first joins its tasks and drops
+        // their exceptions.  Declare it after the locals its tasks use.
+        class TaskGroup
+        {
+            public:
+                TaskGroup() : _pool(nullptr), _pending(0) {}
+
+                ~TaskGroup()
+                {
+                    if (_pool)
+                        _pool->join(*this);
+                }
+
+                TaskGroup(const TaskGroup &) = delete;
+                TaskGroup &operator=(const TaskGroup &) = delete;
+
+            private:
+                friend class WorkStealingPool;
+
+                // Counts a task as done even if it throws.  The group may be
+                // gone as soon as the count reaches zero.
+                struct Done
+                {
+                    explicit Done(TaskGroup &group) : group(group) {}
+
+                    ~Done()
+                    {
+                        WorkStealingPool *pool = group._pool;
+                        if (--group._pending == 0)
+                            pool->notify_joined();
+                    }
+
+                    TaskGroup &group;
+                };
+
+                WorkStealingPool *_pool;
+                std::atomic<size_t> _pending;
+                std::mutex _error_mutex;
+                std::exception_ptr _error;
+        };
+
+        explicit WorkStealingPool(unsigned int n_threads=default_size()) :
+            _queued(0),
+            _stop(false)
+        {
+            if (n_threads == 0)
+                n_threads = 1;
+            for (unsigned int i = 0; i < n_threads; ++i)
+                _queues.emplace_back(new WorkQueue);
+            for (unsigned int i = 0; i < n_threads; ++i)
+                _workers.emplace_back([this, i] { worker_loop(i); });
+        }
+
+        ~WorkStealingPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(_sleep_mutex);
+                _stop = true;
+            }
+            _wakeup.notify_all();
+            for (auto &worker : _workers)
+                worker.join();
+        }
+
+        WorkStealingPool(const WorkStealingPool &) = delete;
+        WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+        unsigned int size() const
+        {
+            return _workers.size();
+        }
+
+        void spawn(TaskGroup &group, std::function<void()> task)
+        {
+            // Set before the group's first task exists, only read after.
+            if (!group._pool)
+                group._pool = this;
+            group._pending += 1;
+            {
+                std::lock_guard<std::mutex> lock(_sleep_mutex);
+                _queued += 1;
+            }
+            WorkQueue &queue = *_queues[current_queue()];
+            try {
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                queue.tasks.push_back([&group, task] {
+                        TaskGroup::Done done(group);
+                        try {
+                            task();
+                        } catch (...) {
+                            std::lock_guard<std::mutex> lock(group._error_mutex);
+                            if (!group._error)
+                                group._error = std::current_exception();
+                        }
+                    });
+            } catch (...) {
+                {
+                    std::lock_guard<std::mutex> lock(_sleep_mutex);
+                    _queued -= 1;
+                }
+                group._pending -= 1;
+                throw;
+            }
+            _wakeup.notify_one();
+        }
+
+        void wait(TaskGroup &group)
+        {
+            join(group);
+
+            std::exception_ptr error;
+            {
+                std::lock_guard<std::mutex> lock(group._error_mutex);
+                std::swap(error, group._error);
+            }
+            if (error)
+                std::rethrow_exception(error);
+        }
+
+        static unsigned int default_size()
+        {
+            unsigned int n = std::thread::hardware_concurrency();
+            return n == 0 ? 1 : n;
+        }
+
+    private:
+        struct WorkQueue
+        {
+            std::mutex mutex;
+            std::deque<std::function<void()>> tasks;
+        };
+
+        // The calling worker's own queue; other threads spread their tasks.
+        unsigned int current_queue()
+        {
+            if (worker_pool() == this)
+                return worker_index();
+            return _next_external++ % _queues.size();
+        }
+
+        // Runs queued tasks until all of group's tasks are done; sleeps
+        // while every one of them is running elsewhere and nothing is queued.
+        void join(TaskGroup &group)
+        {
+            unsigned int own = current_queue();
+            while (group._pending != 0) {
+                if (run_one(own))
+                    continue;
+                std::unique_lock<std::mutex> lock(_sleep_mutex);
+                _wakeup.wait(lock, [this, &group] { return group._pending == 0 || _queued > 0; });
+            }
+        }
+
+        // Taking the lock orders the notification after the check of a
+        // joiner about to sleep.
+        void notify_joined()
+        {
+            {
+                std::lock_guard<std::mutex> lock(_sleep_mutex);
+            }
+            _wakeup.notify_all();
+        }
+
+        bool run_one(unsigned int own)
+        {
+            std::function<void()> task;
+            for (unsigned int i = 0; i < _queues.size() && !task; ++i) {
+                WorkQueue &queue = *_queues[(own + i) % _queues.size()];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if (queue.tasks.empty())
+                    continue;
+                if (i == 0) {
+                    task = std::move(queue.tasks.back());
+                    queue.tasks.pop_back();
+                } else {
+                    task = std::move(queue.tasks.front());
+                    queue.tasks.pop_front();
+                }
+            }
+            if (!task)
+                return false;
+
+            {
+                std::lock_guard<std::mutex> lock(_sleep_mutex);
+                _queued -= 1;
+            }
+            task();
+            return true;
+        }
+
+        void worker_loop(unsigned int index)
+        {
+            worker_pool() = this;
+            worker_index() = index;
+            while (true) {
+                if (run_one(index))
+                    continue;
+                std::unique_lock<std::mutex> lock(_sleep_mutex);
+                _wakeup.wait(lock, [this] { return _stop || _queued > 0; });
+                if (_stop && _queued == 0)
+                    return;
+            }
+        }
+
+        std::vector<std::unique_ptr<WorkQueue>> _queues;
+        std::vector<std::thread> _workers;
+        std::atomic<unsigned int> _next_external{0};
+        std::mutex _sleep_mutex;
+        std::condition_variable _wakeup;
+        size_t _queued;
+        bool _stop;
+
+        static WorkStealingPool *&worker_pool()
+        {
+            static thread_local WorkStealingPool *pool = nullptr;
+            return pool;
+        }
+
+        static unsigned int &worker_index()
+        {
+            static thread_local unsigned int index = 0;
+            return index;
+        }
+};
+
+#endif
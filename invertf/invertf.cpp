@@ -1,25 +1,132 @@
 #include <tuple>
 #include <vector>
+#include <set>
+#include <map>
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <functional>
 #include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
 #include <gmpxx.h>
 #include <cassert>
 
+#include "../common/benchmark.h"
+#include "../common/work_stealing_pool.h"
+
 using namespace std;
 
 typedef mpz_class Integer;
-//typedef int Integer;
 
-typedef pair<Integer, Integer> Point;
+template<class Int>
+using BasicPoint = pair<Int, Int>;
 
-template<class F>
-Integer bsearch(const F &f, const Point &range, const Integer &value)
+typedef BasicPoint<Integer> Point;
+
+// A fixed-width integer whose arithmetic throws overflow_error instead of
+// wrapping around.
+template<class T>
+class Checked
 {
-    Integer left = range.first;
-    Integer right = range.second;
-    while (left + Integer(1) < right) {
-        Integer middle = (left + right)/2;
+    public:
+        Checked(T value=0) : _value(value) {}
+
+        T value() const { return _value; }
+
+        friend Checked operator+(const Checked &a, const Checked &b)
+        {
+            T result;
+            if (__builtin_add_overflow(a._value, b._value, &result))
+                throw overflow_error("Checked: addition overflows");
+            return result;
+        }
+
+        friend Checked operator-(const Checked &a, const Checked &b)
+        {
+            T result;
+            if (__builtin_sub_overflow(a._value, b._value, &result))
+                throw overflow_error("Checked: subtraction overflows");
+            return result;
+        }
+
+        friend Checked operator*(const Checked &a, const Checked &b)
+        {
+            T result;
+            if (__builtin_mul_overflow(a._value, b._value, &result))
+                throw overflow_error("Checked: multiplication overflows");
+            return result;
+        }
+
+        friend Checked operator/(const Checked &a, const Checked &b) { return a._value/b._value; }
+        friend Checked operator%(const Checked &a, const Checked &b) { return a._value % b._value; }
+
+        Checked &operator+=(const Checked &other) { return *this = *this + other; }
+        Checked &operator*=(const Checked &other) { return *this = *this*other; }
+        Checked &operator/=(const Checked &other) { return *this = *this/other; }
+        Checked &operator++() { return *this += 1; }
+
+        friend bool operator==(const Checked &a, const Checked &b) { return a._value == b._value; }
+        friend bool operator!=(const Checked &a, const Checked &b) { return a._value != b._value; }
+        friend bool operator<(const Checked &a, const Checked &b) { return a._value < b._value; }
+        friend bool operator<=(const Checked &a, const Checked &b) { return a._value <= b._value; }
+        friend bool operator>(const Checked &a, const Checked &b) { return a._value > b._value; }
+        friend bool operator>=(const Checked &a, const Checked &b) { return a._value >= b._value; }
+
+    private:
+        T _value;
+};
+
+Integer
+to_integer(int64_t value)
+{
+    return Integer(static_cast<long>(value));
+}
+
+Integer
+to_integer(__int128 value)
+{
+    Integer high = to_integer(static_cast<int64_t>(value >> 64));
+    Integer low = static_cast<unsigned long>(static_cast<uint64_t>(value));
+    return (high << 64) + low;
+}
+
+template<class T>
+Integer
+to_integer(const Checked<T> &value)
+{
+    return to_integer(value.value());
+}
+
+// Whether a non-negative value fits into T, and the conversion itself.
+template<class T>
+bool
+fits(const Integer &value)
+{
+    return sgn(value) >= 0 &&
+        mpz_sizeinbase(value.get_mpz_t(), 2) <= static_cast<size_t>(numeric_limits<T>::digits - 1);
+}
+
+template<class T>
+T
+from_integer(const Integer &value)
+{
+    Integer high = value >> 64;
+    Integer low = value - (high << 64);
+    return static_cast<T>((static_cast<unsigned __int128>(high.get_ui()) << 64) | low.get_ui());
+}
+
+template<class F, class Int>
+Int bsearch(const F &f, const BasicPoint<Int> &range, const Int &value)
+{
+    Int left = range.first;
+    Int right = range.second;
+    while (left + Int(1) < right) {
+        Int middle = (left + right)/2;
         if (f(middle) <= value) {
             left = middle;
         } else {
@@ -29,66 +136,218 @@ Integer bsearch(const F &f, const Point &range, const Integer &value)
     return left;
 }
 
-Point
-extend(const Point &range)
+template<class Int>
+BasicPoint<Int>
+extend(const BasicPoint<Int> &range)
 {
-    return make_pair(range.first - 1, range.second + 1);
+    return make_pair(Int(range.first - 1), Int(range.second + 1));
 }
 
-template<class F>
-void
-find_in_rectangle(F &f, const Point &x_range, const Point &y_range, const Integer &value,
-                  vector<Point> &result)
+template<class Int>
+using Rectangle = pair<BasicPoint<Int>, BasicPoint<Int>>;
+
+// One step of the saddleback search: finds the split point on the middle
+// row or column of the longer side, records it if f hits the value there,
+// and leaves the two sub-rectangles that remain to be searched in parts.
+// Returns false if the rectangle is empty.
+template<class F, class Int>
+bool
+split_rectangle(F &f, const BasicPoint<Int> &x_range, const BasicPoint<Int> &y_range, const Int &value,
+                vector<BasicPoint<Int>> &result, Rectangle<Int> parts[2])
 {
-    Integer x_size = x_range.second - x_range.first;
-    Integer y_size = y_range.second - y_range.first;
-    
+    Int x_size = x_range.second - x_range.first;
+    Int y_size = y_range.second - y_range.first;
+
     if (x_size <= 0 || y_size <= 0)
-        return;
+        return false;
 
     if (x_size > y_size) {
-        Integer y_split = (y_range.first + y_range.second)/2;
-        Integer x_split = bsearch([&f, y_split](Integer x) -> Integer { return f(x, y_split); }, extend(x_range), value);
+        Int y_split = (y_range.first + y_range.second)/2;
+        Int x_split = bsearch([&f, y_split](Int x) -> Int { return f(x, y_split); }, extend(x_range), value);
         if (f(x_split, y_split) == value) {
             result.push_back(make_pair(x_split, y_split));
-            find_in_rectangle(f, make_pair(x_range.first, x_split),
-                              make_pair(y_split + 1, y_range.second), value, result);
+            parts[0] = make_pair(make_pair(x_range.first, x_split),
+                                 make_pair(Int(y_split + 1), y_range.second));
         } else {
-            find_in_rectangle(f, make_pair(x_range.first, x_split + 1),
-                              make_pair(y_split + 1, y_range.second), value, result);
+            parts[0] = make_pair(make_pair(x_range.first, Int(x_split + 1)),
+                                 make_pair(Int(y_split + 1), y_range.second));
         }
-        find_in_rectangle(f, make_pair(x_split + 1, x_range.second),
-                          make_pair(y_range.first, y_split), value, result);
+        parts[1] = make_pair(make_pair(Int(x_split + 1), x_range.second),
+                             make_pair(y_range.first, y_split));
     } else {
-        Integer x_split = (x_range.first + x_range.second)/2;
-        Integer y_split = bsearch([&f, x_split](Integer y) -> Integer { return f(x_split, y); }, extend(y_range), value);
+        Int x_split = (x_range.first + x_range.second)/2;
+        Int y_split = bsearch([&f, x_split](Int y) -> Int { return f(x_split, y); }, extend(y_range), value);
         if (f(x_split, y_split) == value) {
             result.push_back(make_pair(x_split, y_split));
-            find_in_rectangle(f, make_pair(x_split + 1, x_range.second),
-                              make_pair(y_range.first, y_split), value, result);
+            parts[0] = make_pair(make_pair(Int(x_split + 1), x_range.second),
+                                 make_pair(y_range.first, y_split));
         } else {
-            find_in_rectangle(f, make_pair(x_split + 1, x_range.second),
-                              make_pair(y_range.first, y_split + 1), value, result);
+            parts[0] = make_pair(make_pair(Int(x_split + 1), x_range.second),
+                                 make_pair(y_range.first, Int(y_split + 1)));
         }
-        find_in_rectangle(f, make_pair(x_range.first, x_split),
-                          make_pair(y_split + 1, y_range.second), value, result);
+        parts[1] = make_pair(make_pair(x_range.first, x_split),
+                             make_pair(Int(y_split + 1), y_range.second));
+    }
+    return true;
+}
+
+template<class F, class Int>
+void
+find_in_rectangle(F &f, const BasicPoint<Int> &x_range, const BasicPoint<Int> &y_range, const Int &value,
+                  vector<BasicPoint<Int>> &result)
+{
+    Rectangle<Int> parts[2];
+    if (!split_rectangle(f, x_range, y_range, value, result, parts))
+        return;
+    find_in_rectangle(f, parts[0].first, parts[0].second, value, result);
+    find_in_rectangle(f, parts[1].first, parts[1].second, value, result);
+}
 
+// find_in_rectangle() with the first sub-rectangle forked onto the pool
+// while the current task searches the second.  The forked task collects
+// its points in a buffer of its own, appended once it has been joined.
+// Rectangles whose sides add up to less than cutoff are searched serially.
+template<class F, class Int>
+void
+parallel_find_in_rectangle(WorkStealingPool &pool, F &f,
+                           const BasicPoint<Int> &x_range, const BasicPoint<Int> &y_range,
+                           const Int &value, vector<BasicPoint<Int>> &result, const Int &cutoff)
+{
+    if ((x_range.second - x_range.first) + (y_range.second - y_range.first) < cutoff) {
+        find_in_rectangle(f, x_range, y_range, value, result);
+        return;
     }
+
+    Rectangle<Int> parts[2];
+    if (!split_rectangle(f, x_range, y_range, value, result, parts))
+        return;
+
+    vector<BasicPoint<Int>> forked_result;
+    WorkStealingPool::TaskGroup group;
+    pool.spawn(group, [&pool, &f, &parts, &value, &forked_result, &cutoff] {
+            parallel_find_in_rectangle(pool, f, parts[0].first, parts[0].second,
+                                       value, forked_result, cutoff);
+        });
+    parallel_find_in_rectangle(pool, f, parts[1].first, parts[1].second, value, result, cutoff);
+    pool.wait(group);
+    result.insert(end(result), begin(forked_result), end(forked_result));
 }
 
-template<class F>
-vector<Point>
-invertf(F &f, const Integer &value)
+template<class F, class Int>
+vector<BasicPoint<Int>>
+invertf(F &f, const Int &value)
 {
-    vector<Point> result;
-    Integer x_max = bsearch([&f](Integer x) -> Integer { return f(x, 0); }, make_pair(Integer(0), value + 1), value) + 1;
-    Integer y_max = bsearch([&f](Integer y) -> Integer { return f(0, y); }, make_pair(Integer(0), value + 1), value) + 1;
-    find_in_rectangle(f, make_pair(Integer(0), x_max), make_pair(Integer(0), y_max), value, result);
+    vector<BasicPoint<Int>> result;
+    Int x_max = bsearch([&f](Int x) -> Int { return f(x, 0); }, make_pair(Int(0), Int(value + 1)), value) + 1;
+    Int y_max = bsearch([&f](Int y) -> Int { return f(0, y); }, make_pair(Int(0), Int(value + 1)), value) + 1;
+    find_in_rectangle(f, make_pair(Int(0), x_max), make_pair(Int(0), y_max), value, result);
 
     return result;
 }
 
-template<class F>
+// Solutions of f(x, y) = t for every t of an ascending list of targets, in
+// one walk over the columns x = 0, 1, ...  For each target the walk keeps
+// the highest y with f(x, y) <= t, which can only go down as x grows.  The
+// staircases of nearby targets cross the same points, so the values of the
+// current column are kept and shared between targets.  Points come out
+// ordered by x.
+template<class F, class Int>
+vector<vector<BasicPoint<Int>>>
+invertf_batch(F &f, const vector<Int> &targets)
+{
+    vector<vector<BasicPoint<Int>>> result(targets.size());
+    if (targets.empty())
+        return result;
+    assert(is_sorted(begin(targets), end(targets)));
+
+    const Int &last_target = targets.back();
+    Int y_max = bsearch([&f](Int y) -> Int { return f(0, y); },
+                        make_pair(Int(0), Int(last_target + 1)), last_target);
+    vector<Int> y_below(targets.size(), y_max);
+    size_t first_active = 0;
+
+    map<Int, Int> column;
+    for (Int x = 0; first_active < targets.size(); ++x) {
+        column.clear();
+        auto eval = [&f, &x, &column](const Int &y) -> Int {
+            auto it = column.find(y);
+            if (it == column.end())
+                it = column.insert(make_pair(y, f(x, y))).first;
+            return it->second;
+        };
+
+        for (size_t t = first_active; t < targets.size(); ++t) {
+            Int &y = y_below[t];
+            while (y >= 0 && eval(y) > targets[t])
+                --y;
+            if (y >= 0 && eval(y) == targets[t])
+                result[t].push_back(make_pair(x, y));
+        }
+        // A target whose staircase has left the grid is done; those are
+        // always the smallest remaining ones.
+        while (first_active < targets.size() && y_below[first_active] < 0)
+            ++first_active;
+    }
+
+    return result;
+}
+
+// Every (x, y, f(x, y)) with lo <= f(x, y) <= hi, ordered by x and then y.
+// The band between the two staircases is walked column by column, so f is
+// evaluated O(x_max + y_max) times beyond the points reported.
+template<class F, class Int>
+vector<tuple<Int, Int, Int>>
+invertf_range(F &f, const Int &lo, const Int &hi)
+{
+    vector<tuple<Int, Int, Int>> result;
+    Int y_high = bsearch([&f](Int y) -> Int { return f(0, y); }, make_pair(Int(0), Int(hi + 1)), hi);
+    Int y_low = y_high;
+
+    map<Int, Int> column;
+    for (Int x = 0; y_high >= 0; ++x) {
+        column.clear();
+        auto eval = [&f, &x, &column](const Int &y) -> Int {
+            auto it = column.find(y);
+            if (it == column.end())
+                it = column.insert(make_pair(y, f(x, y))).first;
+            return it->second;
+        };
+
+        while (y_high >= 0 && eval(y_high) > hi)
+            --y_high;
+        if (y_low > y_high)
+            y_low = y_high;
+        while (y_low > 0 && eval(Int(y_low - 1)) >= lo)
+            --y_low;
+
+        for (Int y = y_low; y <= y_high; ++y) {
+            Int value = eval(y);
+            if (value >= lo)
+                result.push_back(make_tuple(x, y, value));
+        }
+    }
+
+    return result;
+}
+
+// invertf() with the saddleback search spread over the pool.  f is called
+// from several threads at once.  The result is sorted, so it does not
+// depend on the order in which tasks finish.
+template<class F, class Int>
+vector<BasicPoint<Int>>
+parallel_invertf(WorkStealingPool &pool, F &f, const Int &value, const Int &cutoff=64)
+{
+    vector<BasicPoint<Int>> result;
+    Int x_max = bsearch([&f](Int x) -> Int { return f(x, 0); }, make_pair(Int(0), Int(value + 1)), value) + 1;
+    Int y_max = bsearch([&f](Int y) -> Int { return f(0, y); }, make_pair(Int(0), Int(value + 1)), value) + 1;
+    parallel_find_in_rectangle(pool, f, make_pair(Int(0), x_max), make_pair(Int(0), y_max), value, result, cutoff);
+    sort(begin(result), end(result));
+
+    return result;
+}
+
+// Counter may be atomic<int> for a wrapper shared between threads.
+template<class F, class Int=Integer, class Counter=int>
 class FunctionWrapper
 {
     public:
@@ -98,7 +357,7 @@ class FunctionWrapper
         {
         }
 
-        Integer operator()(Integer x, Integer y)
+        Int operator()(Int x, Int y)
         {
             if (x < 0 || y < 0)
                 return -1;
@@ -113,9 +372,150 @@ class FunctionWrapper
 
     private:
         const F &_f;
-        int _invokations;
+        Counter _invokations;
+};
+
+inline uint64_t
+hash_value(const Integer &x)
+{
+    return mpz_getlimbn(x.get_mpz_t(), 0);
+}
+
+template<class T>
+uint64_t
+hash_value(const T &x)
+{
+    return static_cast<uint64_t>(x);
+}
+
+template<class T>
+uint64_t
+hash_value(const Checked<T> &x)
+{
+    return hash_value(x.value());
+}
+
+// FunctionWrapper that remembers recent values of f in a fixed-size,
+// four-way set-associative table keyed on (x, y), replacing entries round
+// robin within a set.  Besides the requested evaluations it counts hits
+// and misses (actual evaluations of f).  With count_unique it also counts
+// the distinct points evaluated, which takes a set of every point missed,
+// so that is meant for checks rather than timed runs.
+template<class F, class Int=Integer>
+class CachingFunctionWrapper
+{
+    public:
+        CachingFunctionWrapper(const F &f, size_t capacity=4096, bool count_unique=false) :
+            _f(f),
+            _n_sets(1),
+            _count_unique(count_unique),
+            _hits(0),
+            _misses(0)
+        {
+            while (_n_sets*ways < capacity)
+                _n_sets *= 2;
+            _entries.resize(_n_sets*ways);
+            _next_victim.assign(_n_sets, 0);
+        }
+
+        Int operator()(Int x, Int y)
+        {
+            if (x < 0 || y < 0)
+                return -1;
+
+            uint64_t h = hash_value(x)*0x9e3779b97f4a7c15ull ^ hash_value(y);
+            size_t set = (h ^ (h >> 29)) & (_n_sets - 1);
+            Entry *first = &_entries[set*ways];
+            for (unsigned int i = 0; i < ways; ++i) {
+                if (first[i].used && first[i].x == x && first[i].y == y) {
+                    _hits += 1;
+                    return first[i].value;
+                }
+            }
+
+            // f may throw, e.g. on Checked<T> overflow, so no entry is
+            // touched until its value is known.
+            _misses += 1;
+            Int value = _f(x, y);
+            if (_count_unique)
+                _evaluated.insert(make_pair(x, y));
+            Entry &victim = first[_next_victim[set]];
+            _next_victim[set] = (_next_victim[set] + 1) % ways;
+            victim.used = true;
+            victim.x = x;
+            victim.y = y;
+            victim.value = value;
+            return value;
+        }
+
+        int getInvokationCount() const
+        {
+            return _hits + _misses;
+        }
+
+        int getHitCount() const
+        {
+            return _hits;
+        }
+
+        int getMissCount() const
+        {
+            return _misses;
+        }
+
+        // -1 unless constructed with count_unique.
+        int getUniqueCount() const
+        {
+            return _count_unique ? static_cast<int>(_evaluated.size()) : -1;
+        }
+
+    private:
+        static const unsigned int ways = 4;
+
+        struct Entry
+        {
+            Entry() : used(false) {}
+
+            bool used;
+            Int x;
+            Int y;
+            Int value;
+        };
+
+        const F &_f;
+        size_t _n_sets;
+        vector<Entry> _entries;
+        vector<unsigned char> _next_victim;
+        bool _count_unique;
+        set<BasicPoint<Int>> _evaluated;
+        int _hits;
+        int _misses;
 };
 
+// invertf() in Checked<T> arithmetic, retried in GMP if the value does not
+// fit into T or any evaluation of f overflows on the way.
+template<class T, class F>
+vector<Point>
+invertf_checked(const F &f, const Integer &value, bool &fell_back)
+{
+    fell_back = true;
+    if (fits<T>(value)) {
+        try {
+            FunctionWrapper<F, Checked<T>> checked_f(f);
+            auto narrow = invertf(checked_f, Checked<T>(from_integer<T>(value)));
+            vector<Point> result;
+            for (const auto &p : narrow)
+                result.push_back(make_pair(to_integer(p.first), to_integer(p.second)));
+            fell_back = false;
+            return result;
+        } catch (const overflow_error &) {
+        }
+    }
+
+    FunctionWrapper<F, Integer> wide_f(f);
+    return invertf(wide_f, value);
+}
+
 template<class F>
 vector<Point>
 brute_force(F &f, const Integer &value)
@@ -130,44 +530,179 @@ brute_force(F &f, const Integer &value)
     return result;
 }
 
-mpz_class
-pow(const mpz_class &base, const mpz_class &exp)
+// Squares base only while bits of exp are left, so that fixed-width types
+// do not overflow on a square the result never uses.
+template<class Int>
+Int
+pow(const Int &base, const Int &exp)
 {
-    mpz_class result = 1;
-    mpz_class tmp = base;
-    for (mpz_class current(exp); current > 0; current /= 2) {
+    Int result = 1;
+    Int tmp = base;
+    for (Int current(exp); current > 0; current /= 2) {
         if (current % 2 == 1)
             result *= tmp;
-        tmp *= tmp;
+        if (current > 1)
+            tmp *= tmp;
     }
 
     return result;
 }
 
+// Times invertf() on the native type T, which is only safe when the checked
+// run got through without overflowing: both evaluate f at the same points.
+template<class T, class F>
+void
+time_fixed_width(BenchmarkRunner &bench, const string &name, const F &f, const Integer &N,
+                 const vector<Point> &reference, const char *type_name)
+{
+    bool fell_back;
+    auto checked = bench.run(name + " checked " + type_name,
+            [&f, &N, &fell_back] { return invertf_checked<T>(f, N, fell_back); });
+    sort(begin(checked), end(checked));
+    assert(checked == reference);
+    if (fell_back) {
+        cout << "  overflow, retried in GMP" << endl;
+        return;
+    }
+
+    FunctionWrapper<F, T> native_f(f);
+    auto native = bench.run(name + " native " + type_name,
+            [&native_f, &N] { return invertf(native_f, from_integer<T>(N)); });
+    assert(native.size() == reference.size());
+}
+
+// Every timed run gets a fresh wrapper, so the call counts printed are
+// those of the last run.
 template<class F>
 void
-test_inversion(const F &_f, Integer N)
+test_inversion(BenchmarkRunner &bench, WorkStealingPool &pool, const string &name, const F &_f, Integer N)
 {
-    auto f = FunctionWrapper<F>(_f);
-    auto result = invertf(f, N);
+    typedef FunctionWrapper<F> Wrapper;
+    shared_ptr<Wrapper> f;
+    auto result = bench.run_with_setup(name + " GMP",
+            [&f, &_f] { f = make_shared<Wrapper>(_f); return f; },
+            [&N](shared_ptr<Wrapper> &w) { return invertf(*w, N); });
     sort(begin(result), end(result));
-    cout << f.getInvokationCount() << " function calls" << endl;
+    auto serial_ns = bench.last().median_ns;
+    cout << "  " << f->getInvokationCount() << " function calls" << endl;
+
+    typedef CachingFunctionWrapper<F> CachingWrapper;
+    shared_ptr<CachingWrapper> cached_f;
+    auto cached = bench.run_with_setup(name + " cached",
+            [&cached_f, &_f] { cached_f = make_shared<CachingWrapper>(_f); return cached_f; },
+            [&N](shared_ptr<CachingWrapper> &w) { return invertf(*w, N); });
+    sort(begin(cached), end(cached));
+    assert(cached == result);
+    CachingWrapper counting_f(_f, 4096, true);
+    invertf(counting_f, N);
+    assert(counting_f.getMissCount() == cached_f->getMissCount());
+    cout << "  " << cached_f->getInvokationCount() << " calls, "
+         << cached_f->getHitCount() << " hits, "
+         << cached_f->getMissCount() << " misses, "
+         << counting_f.getUniqueCount() << " unique evaluations" << endl;
+
+    FunctionWrapper<F, Integer, atomic<int>> shared_f(_f);
+    auto parallel = bench.run(name + " parallel (" + to_string(pool.size()) + " threads)",
+            [&pool, &shared_f, &N] { return parallel_invertf(pool, shared_f, N); });
+    assert(parallel == result);
+    cout << "  speedup " << serial_ns/bench.last().median_ns << endl;
+
+    time_fixed_width<int64_t>(bench, name, _f, N, result, "int64_t");
+    time_fixed_width<__int128>(bench, name, _f, N, result, "__int128");
+
+    // A hundred and one neighbouring targets, one at a time and in one walk.
+    vector<Integer> targets;
+    for (Integer t = N - 100; t <= N; ++t)
+        targets.push_back(t);
+    auto looped_f = FunctionWrapper<F>(_f);
+    vector<vector<Point>> looped;
+    for (const auto &t : targets) {
+        looped.push_back(invertf(looped_f, t));
+        sort(begin(looped.back()), end(looped.back()));
+    }
+    auto batch_f = FunctionWrapper<F>(_f);
+    auto batch = invertf_batch(batch_f, targets);
+    assert(batch == looped);
+    cout << "  " << targets.size() << " targets: "
+         << static_cast<double>(looped_f.getInvokationCount())/targets.size()
+         << " calls per target looped, "
+         << static_cast<double>(batch_f.getInvokationCount())/targets.size()
+         << " batched" << endl;
+
+    auto range_f = FunctionWrapper<F>(_f);
+    auto range = invertf_range(range_f, targets.front(), targets.back());
+    size_t n_solutions = 0;
+    for (const auto &points : batch)
+        n_solutions += points.size();
+    assert(range.size() == n_solutions);
+    cout << "  range [" << targets.front() << ", " << targets.back() << "]: "
+         << range.size() << " points, " << range_f.getInvokationCount() << " calls" << endl;
 
-    auto reference = brute_force(f, N);
+    auto reference = brute_force(*f, N);
     sort(begin(reference), end(reference));
 
     assert(equal(begin(result), end(result), begin(reference)));
 }
 
+// The test functions are written once for every integer type.
+struct F1 { template<class Int> Int operator()(Int x, Int y) const { return pow(Int(2), y)*(2*x + 1) - 1; } };
+struct F2 { template<class Int> Int operator()(Int x, Int y) const { return x*pow(Int(2), x) + y*pow(Int(2), y) + 2*x + y; } };
+struct F3 { template<class Int> Int operator()(Int x, Int y) const { return x*3 + y*27 + y*y; } };
+struct F4 { template<class Int> Int operator()(Int x, Int y) const { return x*x + y*y + x + y; } };
+struct F5 { template<class Int> Int operator()(Int x, Int y) const { return x + pow(Int(2), y) + y - 1; } };
+
+#ifdef COUNT_ALLOCATIONS
+// GMP gets its limbs from malloc() rather than operator new, and passes
+// block sizes back on reallocation and release, so its temporaries can be
+// counted without a size prefix.
+void *counted_gmp_allocate(size_t size)
+{
+    void *p = malloc(size);
+    if (!p)
+        abort();
+    AllocationCounter::allocated(size);
+    return p;
+}
+
+void *counted_gmp_reallocate(void *p, size_t old_size, size_t new_size)
+{
+    p = realloc(p, new_size);
+    if (!p)
+        abort();
+    AllocationCounter::freed(old_size);
+    AllocationCounter::allocated(new_size);
+    return p;
+}
+
+void counted_gmp_free(void *p, size_t size)
+{
+    AllocationCounter::freed(size);
+    free(p);
+}
+#endif
+
 int main()
 {
+#ifdef COUNT_ALLOCATIONS
+    mp_set_memory_functions(counted_gmp_allocate, counted_gmp_reallocate, counted_gmp_free);
+#endif
+
+    // The largest powers of two that fit must not overflow on the way.
+    assert(pow(Checked<int64_t>(2), Checked<int64_t>(62)) == Checked<int64_t>(int64_t(1) << 62));
+    assert(pow(__int128(2), __int128(126)) == __int128(1) << 126);
+
     Integer N = 5000;
 
-    test_inversion([] (Integer x, Integer y) -> Integer { return pow(Integer(2),  y)*(2*x + 1) - 1; }, N);
-    test_inversion([] (Integer x, Integer y) -> Integer { return x*pow(Integer(2),  x) + y*pow(Integer(2), y) + 2*x + y; }, N);
-    test_inversion([] (Integer x, Integer y) -> Integer { return x*3 + y*27 + y*y; }, N);
-    test_inversion([] (Integer x, Integer y) -> Integer { return x*x + y*y + x + y; }, N);
-    test_inversion([] (Integer x, Integer y) -> Integer { return x + pow(Integer(2),  y) + y - 1; }, N);
+    // The pool's workers are started after the counters are opened, so
+    // that their events are counted too.
+    BenchmarkRunner bench("invertf");
+    WorkStealingPool pool;
+
+    test_inversion(bench, pool, "F1", F1(), N);
+    test_inversion(bench, pool, "F2", F2(), N);
+    test_inversion(bench, pool, "F3", F3(), N);
+    test_inversion(bench, pool, "F4", F4(), N);
+    test_inversion(bench, pool, "F5", F5(), N);
 
     return 0;
 }
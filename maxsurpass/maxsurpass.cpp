@@ -1,36 +1,48 @@
 #include "../common/benchmark.h"
+#include "../common/common.h"
 #include "../common/sequence_generator.h"
+#include "../common/thread_pool.h"
 
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
 
 using namespace std;
 
 typedef int var_t;
 
-struct table_entry_t : public pair<var_t, unsigned int>
+template<class K>
+struct table_entry_t : public pair<K, unsigned int>
 {
     table_entry_t()
     {
     }
 
-    table_entry_t(const var_t &value, unsigned int count)
-        : pair<var_t, unsigned int>(value, count)
+    table_entry_t(const K &value, unsigned int count)
+        : pair<K, unsigned int>(value, count)
     {
     }
-
-    bool operator<(const table_entry_t &other)
-    {
-        return this->first < other.first;
-    }
 };
 
-vector<table_entry_t>::iterator
-merge_tables(vector<table_entry_t>::const_iterator first_left,
-      vector<table_entry_t>::const_iterator last_left,
-      vector<table_entry_t>::const_iterator first_right,
-      vector<table_entry_t>::const_iterator last_right,
-      vector<table_entry_t>::iterator result)
+template<class K, class Compare>
+typename vector<table_entry_t<K>>::iterator
+merge_tables(typename vector<table_entry_t<K>>::const_iterator first_left,
+      typename vector<table_entry_t<K>>::const_iterator last_left,
+      typename vector<table_entry_t<K>>::const_iterator first_right,
+      typename vector<table_entry_t<K>>::const_iterator last_right,
+      typename vector<table_entry_t<K>>::iterator result,
+      Compare comp,
+      unsigned int right_tail=0)
 {
     while (true) {
         if (first_left == last_left) {
@@ -38,13 +50,16 @@ merge_tables(vector<table_entry_t>::const_iterator first_left,
             break;
         }
         if (first_right == last_right) {
-            result = copy(first_left, last_left, result);
+            result = transform(first_left, last_left, result,
+                    [right_tail](const table_entry_t<K> &e) {
+                        return table_entry_t<K>(e.first, e.second + right_tail);
+                    });
             break;
         }
 
-        if (*first_left < *first_right) {
-            auto n = last_right - first_right;
-            *result = table_entry_t(first_left->first, first_left->second + n);
+        if (comp(first_left->first, first_right->first)) {
+            auto n = (last_right - first_right) + right_tail;
+            *result = table_entry_t<K>(first_left->first, first_left->second + n);
             ++result;
             ++first_left;
         } else {
@@ -56,23 +71,26 @@ merge_tables(vector<table_entry_t>::const_iterator first_left,
     return result;
 }
 
-vector<table_entry_t>
-table(const vector<var_t> &values)
+// Surpassers are counted with respect to comp: a later value y surpasses x
+// when comp(x, y).
+template<class K, class Compare=less<K>>
+vector<table_entry_t<K>>
+table(const vector<K> &values, Compare comp=Compare())
 {
-    vector<table_entry_t> current_row(values.size());
-    vector<table_entry_t> next_row(values.size());
+    vector<table_entry_t<K>> current_row(values.size());
+    vector<table_entry_t<K>> next_row(values.size());
 
     transform(values.begin(), values.end(), current_row.begin(),
-            [](const var_t &v) {return table_entry_t(v, 0u);});
+            [](const K &v) {return table_entry_t<K>(v, 0u);});
 
     for (auto scale = 1u; scale < current_row.size(); scale *= 2) {
-        auto first_left = current_row.begin();
+        auto first_left = current_row.cbegin();
         auto output = next_row.begin();
-        while (first_left < current_row.end()) {
-            auto last_left = min(first_left + scale, current_row.end());
+        while (first_left < current_row.cend()) {
+            auto last_left = min(first_left + scale, current_row.cend());
             auto first_right = last_left;
-            auto last_right = min(first_right + scale, current_row.end());
-            output = merge_tables(first_left, last_left, first_right, last_right, output);
+            auto last_right = min(first_right + scale, current_row.cend());
+            output = merge_tables<K>(first_left, last_left, first_right, last_right, output, comp);
             first_left = last_right;
         }
         swap(current_row, next_row);
@@ -80,21 +98,487 @@ table(const vector<var_t> &values)
     return current_row;
 }
 
-unsigned int max_surpasser(const vector<var_t> &values)
+// Number of left entries among the first d entries merge_tables() emits,
+// i.e. the largest i whose left[i - 1] goes out before right[d - i].
+template<class K, class Compare>
+size_t
+co_rank(size_t d,
+        typename vector<table_entry_t<K>>::const_iterator left, size_t left_size,
+        typename vector<table_entry_t<K>>::const_iterator right, size_t right_size,
+        Compare comp)
+{
+    size_t lo = d > right_size ? d - right_size : 0;
+    size_t hi = min(d, left_size);
+    while (lo < hi) {
+        size_t i = hi - (hi - lo)/2;
+        if (comp((left + (i - 1))->first, (right + (d - i))->first))
+            lo = i;
+        else
+            hi = i - 1;
+    }
+    return lo;
+}
+
+// Same levels as table(), with the merges of each level spread over the
+// pool.  When a level has fewer pairs of runs than there are threads, each
+// merge is cut into segments along its merge path; a segment's left entries
+// still count the right entries of the later segments as surpassers.
+template<class K, class Compare=less<K>>
+vector<table_entry_t<K>>
+parallel_table(const vector<K> &values, ThreadPool &pool, Compare comp=Compare())
+{
+    vector<table_entry_t<K>> current_row(values.size());
+    vector<table_entry_t<K>> next_row(values.size());
+    const size_t n = values.size();
+    const unsigned int n_tasks = pool.size();
+
+    pool.parallel_for(n_tasks, [&](unsigned int t) {
+            for (size_t i = n*t/n_tasks; i < n*(t + 1)/n_tasks; ++i)
+                current_row[i] = table_entry_t<K>(values[i], 0u);
+        });
+
+    for (size_t scale = 1; scale < n; scale *= 2) {
+        const size_t n_pairs = (n + 2*scale - 1)/(2*scale);
+        const size_t segments = (n_tasks + n_pairs - 1)/n_pairs;
+
+        auto merge_segment = [&](size_t pair, size_t segment) {
+            auto first_left = current_row.cbegin() + pair*2*scale;
+            size_t left_size = min(scale, n - pair*2*scale);
+            auto first_right = first_left + left_size;
+            size_t right_size = min(scale, n - pair*2*scale - left_size);
+
+            size_t d_first = (left_size + right_size)*segment/segments;
+            size_t d_last = (left_size + right_size)*(segment + 1)/segments;
+            size_t i_first = co_rank<K>(d_first, first_left, left_size, first_right, right_size, comp);
+            size_t i_last = co_rank<K>(d_last, first_left, left_size, first_right, right_size, comp);
+            size_t j_first = d_first - i_first;
+            size_t j_last = d_last - i_last;
+
+            merge_tables<K>(first_left + i_first, first_left + i_last,
+                            first_right + j_first, first_right + j_last,
+                            next_row.begin() + pair*2*scale + d_first,
+                            comp, right_size - j_last);
+        };
+
+        if (segments == 1) {
+            pool.parallel_for(n_tasks, [&](unsigned int t) {
+                    for (size_t pair = n_pairs*t/n_tasks; pair < n_pairs*(t + 1)/n_tasks; ++pair)
+                        merge_segment(pair, 0);
+                });
+        } else {
+            pool.parallel_for(n_pairs*segments, [&](unsigned int t) {
+                    merge_segment(t/segments, t%segments);
+                });
+        }
+        swap(current_row, next_row);
+    }
+    return current_row;
+}
+
+template<class K>
+unsigned int max_count(const vector<table_entry_t<K>> &table_values)
 {
-    auto table_values = table(values);
     auto max = max_element(table_values.begin(), table_values.end(),
-                    [](const table_entry_t &a, const table_entry_t &b) {
+                    [](const table_entry_t<K> &a, const table_entry_t<K> &b) {
                         return a.second < b.second;
                     });
     return max->second;
 }
 
-int main()
+template<class K, class Compare=less<K>>
+unsigned int max_surpasser(const vector<K> &values, Compare comp=Compare())
+{
+    return max_count(table(values, comp));
+}
+
+template<class K, class Compare=less<K>>
+unsigned int max_surpasser(const vector<K> &values, ThreadPool &pool, Compare comp=Compare())
+{
+    return max_count(parallel_table(values, pool, comp));
+}
+
+// Order-preserving maps of fixed-width keys onto unsigned integers, for
+// radix_max_surpasser().
+template<class K>
+typename enable_if<is_integral<K>::value, typename make_unsigned<K>::type>::type
+radix_key(K key)
+{
+    typedef typename make_unsigned<K>::type U;
+    U u = static_cast<U>(key);
+    if (is_signed<K>::value)
+        u ^= U(1) << (numeric_limits<U>::digits - 1);
+    return u;
+}
+
+inline uint32_t radix_key(float key)
+{
+    uint32_t u;
+    key = key == 0 ? 0.0f : key;
+    memcpy(&u, &key, sizeof(u));
+    return (u & 0x80000000u) ? ~u : u | 0x80000000u;
+}
+
+inline uint64_t radix_key(double key)
+{
+    uint64_t u;
+    key = key == 0 ? 0.0 : key;
+    memcpy(&u, &key, sizeof(u));
+    return (u >> 63) ? ~u : u | (uint64_t(1) << 63);
+}
+
+// max_surpasser() for integer and floating point keys under the usual
+// order, without comparison merges.  A later y surpasses x exactly when the
+// highest digit in which they differ is larger in y, so the keys are
+// processed four bits at a time from the top, as in an MSD radix sort:
+// within each run of keys sharing the digits above, an element gains the
+// number of later elements with a larger digit, and the run is then stably
+// bucketed by the digit.  Bits that are the same in every key are skipped.
+template<class K>
+unsigned int radix_max_surpasser(const vector<K> &values)
+{
+    typedef decltype(radix_key(K())) U;
+    const unsigned int digit_bits = 4;
+    const unsigned int n_digits = 1u << digit_bits;
+    const int key_bits = numeric_limits<U>::digits;
+
+    const size_t n = values.size();
+    vector<U> keys(n), next_keys(n);
+    vector<unsigned int> counts(n, 0), next_counts(n);
+    transform(begin(values), end(values), begin(keys), [](K v) { return radix_key(v); });
+
+    U any_set = 0, all_set = ~U(0);
+    for (auto k : keys) {
+        any_set |= k;
+        all_set &= k;
+    }
+    const U varying = any_set & ~all_set;
+
+    for (int high = key_bits - 1; high >= 0; ) {
+        if ((varying >> high & 1) == 0) {
+            --high;
+            continue;
+        }
+        const int low = max(0, high - int(digit_bits) + 1);
+        const U above = high + 1 < key_bits ? ~((U(1) << (high + 1)) - 1) : U(0);
+        const U digit_mask = (U(1) << (high - low + 1)) - 1;
+
+        bool shared_prefix = false;
+        for (size_t first = 0; first < n; ) {
+            size_t last = first + 1;
+            while (last < n && ((keys[last] ^ keys[first]) & above) == 0)
+                ++last;
+            if (last - first == 1) {
+                next_keys[first] = keys[first];
+                next_counts[first] = counts[first];
+                ++first;
+                continue;
+            }
+            shared_prefix = true;
+
+            unsigned int greater[n_digits] = {};
+            size_t offsets[n_digits] = {};
+            for (size_t i = last; i-- > first; ) {
+                unsigned int d = keys[i] >> low & digit_mask;
+                counts[i] += greater[d];
+                for (unsigned int e = 0; e < n_digits; ++e)
+                    greater[e] += e < d;
+                ++offsets[d];
+            }
+
+            size_t out = first;
+            for (unsigned int d = 0; d < n_digits; ++d) {
+                size_t size = offsets[d];
+                offsets[d] = out;
+                out += size;
+            }
+            for (size_t i = first; i < last; ++i) {
+                size_t &o = offsets[keys[i] >> low & digit_mask];
+                next_keys[o] = keys[i];
+                next_counts[o] = counts[i];
+                ++o;
+            }
+            first = last;
+        }
+        // Once every key has a prefix of its own, no later digit can add
+        // to any count.
+        if (!shared_prefix)
+            break;
+        swap(keys, next_keys);
+        swap(counts, next_counts);
+        high = low - 1;
+    }
+
+    return n == 0 ? 0 : *max_element(begin(counts), end(counts));
+}
+
+// radix_max_surpasser() has to agree with max_surpasser() on every key
+// type, including repeats, negative values and both zeros of a float.
+template<class K>
+bool radix_matches(const vector<K> &values)
+{
+    return radix_max_surpasser(values) == max_surpasser(values);
+}
+
+// Small sets of each key type over few distinct values, negative ones
+// among them; floats are rounded to quarters, so 0 and -0 both occur.
+bool radix_matches_on_repeats()
+{
+    auto ints = SequenceGenerator<int>(-50, 50).generate(3000);
+    auto wide = SequenceGenerator<int64_t>(-20, 20).generate(3000);
+    auto unsigned_ints = SequenceGenerator<unsigned int>(0, 30).generate(3000);
+    auto floats = SequenceGenerator<float>(-10, 10).generate(3000);
+    for (auto &v : floats)
+        v = round(v*4)/4;
+    vector<double> doubles(begin(floats), end(floats));
+    for (auto &v : doubles)
+        v = -v;
+    return radix_matches(ints) && radix_matches(wide) && radix_matches(unsigned_ints) &&
+        radix_matches(floats) && radix_matches(doubles);
+}
+
+// Serial against parallel table() for 10^6, 10^7, ... up to max_size
+// elements.
+void benchmark_sizes(BenchmarkRunner &bench, size_t max_size, ThreadPool &pool)
+{
+    for (size_t n = 1000000; n <= max_size; n *= 10) {
+        SequenceGenerator<var_t> seq(1, n + n/10);
+        auto values = seq.generate(n);
+
+        auto serial = bench.run(BenchmarkId("Serial table", "n", n), [&values] { return table(values); });
+        auto parallel = bench.run(BenchmarkId("Parallel table (" + to_string(pool.size()) + " threads)", "n", n),
+                [&values, &pool] { return parallel_table(values, pool); });
+        if (serial != parallel)
+            cout << "Serial and parallel tables differ for N=" << n << endl;
+    }
+}
+
+// merge_tables() for the column layout used by surpasser_counts(): keys and
+// original indices are merged as two arrays, and the counts stay in input
+// order so that a left key only has to bump the slot of its index.  A pass
+// moves as many bytes as merge_tables() does, a 4-byte index taking the
+// place of the count, plus one scattered increment per left key, so this
+// does not save merge traffic over table(); carrying the counts along with
+// the keys instead needs the index column as well and measured no faster.
+void
+merge_columns(const var_t *left_keys, const unsigned int *left_index, size_t left_size,
+              const var_t *right_keys, const unsigned int *right_index, size_t right_size,
+              var_t *keys, unsigned int *index, unsigned int *counts)
+{
+    size_t l = 0, r = 0;
+    while (l < left_size && r < right_size) {
+        if (left_keys[l] < right_keys[r]) {
+            counts[left_index[l]] += right_size - r;
+            *keys++ = left_keys[l];
+            *index++ = left_index[l];
+            ++l;
+        } else {
+            *keys++ = right_keys[r];
+            *index++ = right_index[r];
+            ++r;
+        }
+    }
+    keys = copy(left_keys + l, left_keys + left_size, keys);
+    index = copy(left_index + l, left_index + left_size, index);
+    copy(right_keys + r, right_keys + right_size, keys);
+    copy(right_index + r, right_index + right_size, index);
+}
+
+// The surpasser count of every element, in input order.  The input range is
+// read once, straight into the working key column.
+template<class I>
+vector<unsigned int> surpasser_counts(I first, I last)
+{
+    const size_t n = distance(first, last);
+    vector<unsigned int> counts(n, 0);
+    vector<var_t> keys(first, last), next_keys(n);
+    vector<unsigned int> index(n), next_index(n);
+    iota(begin(index), end(index), 0u);
+
+    for (size_t scale = 1; scale < n; scale *= 2) {
+        for (size_t first_left = 0; first_left < n; first_left += 2*scale) {
+            size_t left_size = min(scale, n - first_left);
+            size_t right_size = min(scale, n - first_left - left_size);
+            size_t first_right = first_left + left_size;
+            merge_columns(&keys[first_left], &index[first_left], left_size,
+                          &keys[0] + first_right, &index[0] + first_right, right_size,
+                          &next_keys[first_left], &next_index[first_left], counts.data());
+        }
+        swap(keys, next_keys);
+        swap(index, next_index);
+    }
+    return counts;
+}
+
+vector<unsigned int> surpasser_counts(const vector<var_t> &values)
+{
+    return surpasser_counts(begin(values), end(values));
+}
+
+// The surpasser counts straight from the definition, in O(n^2), to check
+// the other implementations against.
+template<class K>
+vector<unsigned int> brute_force_counts(const vector<K> &values)
+{
+    vector<unsigned int> counts(values.size(), 0);
+    for (size_t i = 0; i < values.size(); ++i) {
+        for (size_t j = i + 1; j < values.size(); ++j)
+            counts[i] += values[i] < values[j];
+    }
+    return counts;
+}
+
+// Surpasser counts over the last W values of a stream.  Values must come
+// from a domain fixed up front, which is coordinate compressed; push()
+// throws invalid_argument for any other value, as the constructor does
+// for an empty window.
+//
+// Let G(u) be the number of values seen so far that are greater than u.
+// An element that arrived when G(v) was s has G(v) - s surpassers now,
+// and of all window elements equal to v the oldest one has the most.  So a
+// max segment tree over the domain keeps, per value, the count of its
+// oldest element in the window: an arrival of v adds one to every slot
+// below v, and an expiry moves a slot on to the next element of the same
+// value (or empties it).  Every update is O(log D).
+class WindowedSurpasser
+{
+    public:
+        WindowedSurpasser(size_t window, vector<var_t> domain) :
+            _domain(move(domain)),
+            _window(window),
+            _arrivals(0),
+            _ring(window),
+            _oldest(0)
+        {
+            if (window == 0)
+                throw invalid_argument("WindowedSurpasser: the window must not be empty");
+            sort(begin(_domain), end(_domain));
+            _domain.erase(unique(begin(_domain), end(_domain)), end(_domain));
+
+            _leaves = 1;
+            while (_leaves < _domain.size())
+                _leaves *= 2;
+            _max.assign(2*_leaves, empty_slot);
+            _add.assign(2*_leaves, 0);
+            _seen.assign(_domain.size() + 1, 0);
+            _tail.assign(_domain.size(), -1);
+        }
+
+        void push(var_t value)
+        {
+            size_t v = lower_bound(begin(_domain), end(_domain), value) - begin(_domain);
+            if (v == _domain.size() || _domain[v] != value)
+                throw invalid_argument("WindowedSurpasser::push(): value outside the domain");
+
+            if (_arrivals >= _window)
+                expire();
+
+            size_t slot = _arrivals % _window;
+            _ring[slot].value = v;
+            _ring[slot].seen_greater = greater_than(v);
+            _ring[slot].next = -1;
+
+            if (_tail[v] == -1)
+                assign(1, 0, _leaves, v, 0);
+            else
+                _ring[_tail[v]].next = slot;
+            _tail[v] = slot;
+
+            range_add(1, 0, _leaves, 0, v, 1);
+            for (size_t i = v + 1; i < _seen.size(); i += i & -i)
+                ++_seen[i];
+            ++_arrivals;
+        }
+
+        unsigned int max_surpasser() const
+        {
+            return _max[1] < 0 ? 0 : _max[1];
+        }
+
+    private:
+        struct Element
+        {
+            size_t value;
+            int64_t seen_greater;
+            int64_t next;
+        };
+
+        static const int64_t empty_slot = numeric_limits<int64_t>::min()/4;
+
+        void expire()
+        {
+            const Element &e = _ring[_oldest % _window];
+            size_t v = e.value;
+            if (e.next == -1) {
+                _tail[v] = -1;
+                assign(1, 0, _leaves, v, empty_slot);
+            } else {
+                assign(1, 0, _leaves, v, greater_than(v) - _ring[e.next].seen_greater);
+            }
+            ++_oldest;
+        }
+
+        // Values seen so far, expired or not, that are greater than the
+        // v-th domain value.
+        int64_t greater_than(size_t v) const
+        {
+            int64_t not_greater = 0;
+            for (size_t i = v + 1; i > 0; i -= i & -i)
+                not_greater += _seen[i];
+            return static_cast<int64_t>(_arrivals) - not_greater;
+        }
+
+        void range_add(size_t node, size_t node_first, size_t node_last,
+                       size_t first, size_t last, int64_t delta)
+        {
+            if (last <= node_first || node_last <= first)
+                return;
+            if (first <= node_first && node_last <= last) {
+                _max[node] += delta;
+                _add[node] += delta;
+                return;
+            }
+            size_t node_middle = (node_first + node_last)/2;
+            range_add(2*node, node_first, node_middle, first, last, delta);
+            range_add(2*node + 1, node_middle, node_last, first, last, delta);
+            _max[node] = max(_max[2*node], _max[2*node + 1]) + _add[node];
+        }
+
+        void assign(size_t node, size_t node_first, size_t node_last,
+                    size_t position, int64_t value)
+        {
+            if (node_last - node_first == 1) {
+                _max[node] = value;
+                _add[node] = 0;
+                return;
+            }
+            size_t node_middle = (node_first + node_last)/2;
+            if (position < node_middle)
+                assign(2*node, node_first, node_middle, position, value - _add[node]);
+            else
+                assign(2*node + 1, node_middle, node_last, position, value - _add[node]);
+            _max[node] = max(_max[2*node], _max[2*node + 1]) + _add[node];
+        }
+
+        vector<var_t> _domain;
+        size_t _window;
+        size_t _arrivals;
+        vector<Element> _ring;
+        size_t _oldest;
+        size_t _leaves;
+        vector<int64_t> _max;
+        vector<int64_t> _add;
+        vector<int64_t> _seen;
+        vector<int64_t> _tail;
+};
+
+const int64_t WindowedSurpasser::empty_slot;
+
+int main(int argc, char **argv)
 {
     const unsigned int N_small = 20;
     const unsigned int N_large = 1000000;
-    duration_type dt;
+
+    BenchmarkRunner bench("maxsurpass");
 
     SequenceGenerator<var_t> small_seq(1, N_small + N_small/10);
     auto values = small_seq.generate(N_small);
@@ -103,29 +587,128 @@ int main()
         cout << v << " ";
     cout << endl;
 
-    auto res = benchmark([&values]() {return max_surpasser(values);}, dt);
+    auto res = bench.run("Small set computation", [&values]() {return max_surpasser(values);});
     cout << "Result: " << res << endl;
-    cout << "Small set computation: "
-         << chrono::duration_cast<chrono::nanoseconds>(dt).count()
-         << "ns" << endl;
+    auto small_counts = surpasser_counts(values);
+    print_sequence(small_counts);
+    if (small_counts != brute_force_counts(values)) {
+        cout << "Surpasser counts differ from the definition" << endl;
+        return 1;
+    }
 
+    // Many repeated values, where ties must not count as surpassers.
+    auto repeated = SequenceGenerator<var_t>(1, 100).generate(3000);
+    if (surpasser_counts(repeated) != brute_force_counts(repeated)) {
+        cout << "Surpasser counts differ from the definition on repeated values" << endl;
+        return 1;
+    }
 
+
+    values = bench.run_with_setup("Large set generation",
+            [] { return SequenceGenerator<var_t>(1, N_large + N_large/10); },
+            [](SequenceGenerator<var_t> &seq) { return seq.generate(N_large); });
+
+    // The first cached() call writes the cache file if an earlier run has
+    // not; the timed ones only map it.
     SequenceGenerator<var_t> large_seq(1, N_large + N_large/10);
-    values = benchmark([&large_seq] {return large_seq.generate(N_large); }, dt);
-    cout << "Large set generation: "
-         << chrono::duration_cast<chrono::milliseconds>(dt).count()
-         << "ms" << endl;
+    large_seq.cached(N_large);
+    auto mapped = bench.run("Large set load from cache",
+            [&large_seq]() {return large_seq.cached(N_large);});
+    cout << "Cached set " << (mapped.size() == values.size() && equal(begin(mapped), end(mapped), begin(values)) ? "matches" : "differs from")
+         << " the generated one" << (mapped.mapped() ? "" : " (not mapped)") << endl;
 
-    res = benchmark([&values]() {return max_surpasser(values);}, dt);
+    res = bench.run("Large set computation", [&values]() {return max_surpasser(values);});
     cout << "Result: " << res << endl;
-    cout << "Large set computation: "
-         << chrono::duration_cast<chrono::milliseconds>(dt).count()
-         << "ms" << endl;
-
-    benchmark([&values] {sort(begin(values), end(values)); return 0;}, dt);
-    cout << "Reference sort: "
-         << chrono::duration_cast<chrono::milliseconds>(dt).count()
-         << "ms" << endl;
+
+    auto counts = bench.run("Large set per-element counts", [&values]() {return surpasser_counts(values);});
+    cout << "Result: " << *max_element(begin(counts), end(counts)) << endl;
+    if (*max_element(begin(counts), end(counts)) != res) {
+        cout << "Per-element counts disagree with max_surpasser()" << endl;
+        return 1;
+    }
+
+    counts = bench.run("Large set per-element counts (mapped)",
+            [&mapped]() {return surpasser_counts(begin(mapped), end(mapped));});
+    cout << "Result: " << *max_element(begin(counts), end(counts)) << endl;
+
+    auto radix_res = bench.run("Large set radix computation", [&values]() {return radix_max_surpasser(values);});
+    cout << "Result: " << radix_res << endl;
+    if (radix_res != res || !radix_matches_on_repeats()) {
+        cout << "Radix and comparison results differ" << endl;
+        return 1;
+    }
+
+    res = bench.run("Large set computation (later smaller values)",
+            [&values]() {return max_surpasser(values, greater<var_t>());});
+    cout << "Result: " << res << endl;
+
+    SequenceGenerator<int64_t> timestamp_seq(1500000000000000ll, 1600000000000000ll);
+    auto timestamps = timestamp_seq.generate(N_large);
+    res = bench.run("Large 64-bit set computation", [&timestamps]() {return max_surpasser(timestamps);});
+    cout << "Result: " << res << endl;
+    radix_res = bench.run("Large 64-bit set radix computation", [&timestamps]() {return radix_max_surpasser(timestamps);});
+    cout << "Result: " << radix_res << endl;
+    if (radix_res != res) {
+        cout << "Radix and comparison results differ on 64-bit keys" << endl;
+        return 1;
+    }
+
+    SequenceGenerator<float> reading_seq(-1000.0, 1000.0);
+    auto readings = reading_seq.generate(N_large);
+    res = bench.run("Large float set computation", [&readings]() {return max_surpasser(readings);});
+    cout << "Result: " << res << endl;
+    radix_res = bench.run("Large float set radix computation", [&readings]() {return radix_max_surpasser(readings);});
+    cout << "Result: " << radix_res << endl;
+    if (radix_res != res) {
+        cout << "Radix and comparison results differ on float keys" << endl;
+        return 1;
+    }
+
+    ThreadPool pool;
+    res = bench.run("Large set parallel computation (" + to_string(pool.size()) + " threads)",
+            [&values, &pool]() {return max_surpasser(values, pool);});
+    cout << "Result: " << res << endl;
+
+    // Check every window of a stream against the batch computation, then
+    // time a long stream.
+    const unsigned int N_window = 64;
+    const unsigned int N_stream = 4000;
+    SequenceGenerator<var_t> stream_seq(1, 200);
+    auto stream = stream_seq.generate(N_stream);
+    vector<var_t> domain(200);
+    iota(begin(domain), end(domain), 1);
+    WindowedSurpasser windowed(N_window, domain);
+    for (size_t i = 0; i < stream.size(); ++i) {
+        windowed.push(stream[i]);
+        size_t first = i + 1 > N_window ? i + 1 - N_window : 0;
+        vector<var_t> window(begin(stream) + first, begin(stream) + i + 1);
+        if (windowed.max_surpasser() != max_surpasser(window)) {
+            cout << "Windowed surpasser mismatch at " << i << endl;
+            return 1;
+        }
+    }
+    cout << "Windowed surpasser matches " << N_stream << " batch windows" << endl;
+
+    domain.resize(N_large + N_large/10);
+    iota(begin(domain), end(domain), 1);
+    res = bench.run_with_setup("Windowed surpasser, " + to_string(values.size()) + " updates",
+            [&domain] { return WindowedSurpasser(N_large/10, domain); },
+            [&values](WindowedSurpasser &windowed) {
+                for (auto v : values)
+                    windowed.push(v);
+                return windowed.max_surpasser();
+            }, BenchmarkOptions(0, 3));
+    cout << "Result: " << res << endl;
+    cout << "Windowed surpasser throughput: "
+         << static_cast<uint64_t>(values.size()/(bench.last().median_ns*1e-9))
+         << "/s" << endl;
+
+    bench.run_with_setup("Reference sort",
+            [&values] { return values; },
+            [](vector<var_t> &v) { sort(begin(v), end(v)); return v.front(); });
+
+    // The largest size can be raised to 10^8 from the command line.
+    benchmark_sizes(bench, argc > 1 ? strtoull(argv[1], nullptr, 10) : 10000000, pool);
 
     return 0;
 }
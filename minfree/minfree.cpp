@@ -1,8 +1,18 @@
 #include "../common/sequence_generator.h"
 #include "../common/benchmark.h"
+#include "../common/thread_pool.h"
+#include "minfree_allocator.h"
 
 #include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <utility>
 
 using namespace std;
 
@@ -33,45 +43,364 @@ T minfree(vector<T> &v)
     return minfrom(static_cast<T>(1), begin(v), end(v));
 }
 
+// Leaves the input untouched: marks every value in [1, n + 1] in a bitmap
+// of n + 1 bits and returns the first unmarked one.
+template<class I, class T=typename iterator_traits<I>::value_type>
+T minfree_bitmap(I first, I last)
+{
+    static_assert(is_unsigned<T>::value, "minfree_bitmap() is only defined for unsigned types");
+    typedef uint64_t word_t;
+    const word_t full_word = ~word_t(0);
+
+    const uint64_t n = distance(first, last);
+    vector<word_t> present(n/64 + 1, 0);
+    for (; first != last; ++first) {
+        uint64_t x = *first;
+        if (x >= 1 && x <= n + 1)
+            present[(x - 1)/64] |= word_t(1) << ((x - 1)%64);
+    }
+
+    // Skip over full stretches eight words at a time; the AND of a block
+    // vectorizes well.  A zero bit always exists among the first n + 1.
+    size_t i = 0;
+    for (; i + 8 <= present.size(); i += 8) {
+        word_t block = full_word;
+        for (size_t j = 0; j < 8; ++j)
+            block &= present[i + j];
+        if (block != full_word)
+            break;
+    }
+    while (present[i] == full_word)
+        ++i;
+
+    return static_cast<T>(i*64 + __builtin_ctzll(~present[i]) + 1);
+}
+
+template<typename T>
+T minfree_bitmap(const vector<T> &v)
+{
+    return minfree_bitmap(begin(v), end(v));
+}
+
+struct FileScanStats
+{
+    FileScanStats() : passes(0), bytes_read(0) {}
+
+    unsigned int passes;
+    uint64_t bytes_read;
+};
+
+// Reads a flat file of T values in buffer-sized chunks and calls f on
+// each of them.
+template<typename T, class F>
+void scan_file(const string &path, vector<T> &buffer, FileScanStats &stats, F f)
+{
+    ifstream in(path, ios::binary);
+    if (!in)
+        throw runtime_error("scan_file(): cannot open " + path);
+
+    while (in) {
+        in.read(reinterpret_cast<char *>(buffer.data()), buffer.size()*sizeof(T));
+        size_t bytes = in.gcount();
+        if (bytes % sizeof(T) != 0)
+            throw runtime_error("scan_file(): truncated value in " + path);
+        stats.bytes_read += bytes;
+        for (size_t i = 0; i < bytes/sizeof(T); ++i)
+            f(buffer[i]);
+    }
+    ++stats.passes;
+}
+
+// minfree() over a file of distinct T values that does not fit in memory.
+// Instead of halving through partition, every pass counts the values
+// falling into each of as many buckets as memory_budget allows and keeps
+// the first bucket that is not full.  Once the candidate range fits in a
+// bitmap, one last pass marks it and the first zero bit is the answer.
+template<typename T>
+T minfree_file(const string &path, size_t memory_budget, FileScanStats &stats)
+{
+    static_assert(is_unsigned<T>::value, "minfree_file() is only defined for unsigned types");
+
+    ifstream in(path, ios::binary | ios::ate);
+    if (!in)
+        throw runtime_error("minfree_file(): cannot open " + path);
+    const uint64_t n = static_cast<uint64_t>(in.tellg())/sizeof(T);
+    in.close();
+
+    // Half of the budget goes to the read buffer, half to counters.
+    const size_t half_budget = memory_budget/2;
+    vector<T> buffer(max<size_t>(1, half_budget/sizeof(T)));
+    const uint64_t n_buckets = max<uint64_t>(2, half_budget/sizeof(uint64_t));
+    const uint64_t bitmap_bits = max<uint64_t>(64, uint64_t(half_budget)*8);
+
+    // The answer lies in [first, last) and fewer than last - first values
+    // fall into that range.
+    uint64_t first = 1;
+    uint64_t last = n + 2;
+    vector<uint64_t> counts(n_buckets);
+    while (last - first > bitmap_bits) {
+        const uint64_t width = (last - first + n_buckets - 1)/n_buckets;
+        fill(begin(counts), end(counts), 0);
+        scan_file(path, buffer, stats, [&counts, first, last, width](T x) {
+                if (x >= first && x < last)
+                    ++counts[(x - first)/width];
+            });
+
+        for (uint64_t i = 0; ; ++i) {
+            uint64_t bucket_first = first + i*width;
+            uint64_t bucket_last = min(last, bucket_first + width);
+            if (counts[i] < bucket_last - bucket_first) {
+                first = bucket_first;
+                last = bucket_last;
+                break;
+            }
+        }
+    }
+    counts = vector<uint64_t>();
+
+    vector<uint64_t> present((last - first + 63)/64, 0);
+    scan_file(path, buffer, stats, [&present, first, last](T x) {
+            if (x >= first && x < last)
+                present[(x - first)/64] |= uint64_t(1) << ((x - first)%64);
+        });
+
+    size_t i = 0;
+    while (present[i] == ~uint64_t(0))
+        ++i;
+    return static_cast<T>(first + i*64 + __builtin_ctzll(~present[i]));
+}
+
+template<typename T>
+typename vector<T>::iterator
+parallel_partition(ThreadPool &pool, T split_value,
+                   typename vector<T>::iterator first,
+                   typename vector<T>::iterator last)
+{
+    typedef typename vector<T>::difference_type diff_t;
+
+    const diff_t n = last - first;
+    const unsigned int n_blocks = pool.size();
+    vector<diff_t> block_first(n_blocks + 1);
+    for (unsigned int i = 0; i <= n_blocks; ++i)
+        block_first[i] = n*i/n_blocks;
+
+    // Partition every block on its own.
+    vector<diff_t> block_split(n_blocks);
+    pool.parallel_for(n_blocks, [&](unsigned int i) {
+            auto split = partition(first + block_first[i], first + block_first[i + 1],
+                    [split_value](T x) { return x < split_value; });
+            block_split[i] = split - first;
+        });
+
+    diff_t small_count = 0;
+    for (unsigned int i = 0; i < n_blocks; ++i)
+        small_count += block_split[i] - block_first[i];
+
+    // The large elements of a block that lie before small_count and the small
+    // elements that lie after it are out of place.  Both groups have the same
+    // size, so swapping the k-th element of one with the k-th of the other
+    // finishes the partition.
+    vector<diff_t> misplaced_large(n_blocks + 1, 0);
+    vector<diff_t> misplaced_small(n_blocks + 1, 0);
+    for (unsigned int i = 0; i < n_blocks; ++i) {
+        misplaced_large[i + 1] = max<diff_t>(0,
+                min(block_first[i + 1], small_count) - block_split[i]);
+        misplaced_small[i + 1] = max<diff_t>(0,
+                block_split[i] - max(block_first[i], small_count));
+    }
+    partial_sum(misplaced_large.begin(), misplaced_large.end(), misplaced_large.begin());
+    partial_sum(misplaced_small.begin(), misplaced_small.end(), misplaced_small.begin());
+
+    const diff_t n_misplaced = misplaced_large.back();
+    pool.parallel_for(n_blocks, [&](unsigned int chunk) {
+            diff_t k = n_misplaced*chunk/n_blocks;
+            diff_t k_last = n_misplaced*(chunk + 1)/n_blocks;
+            if (k == k_last)
+                return;
+
+            unsigned int lb = upper_bound(misplaced_large.begin(), misplaced_large.end(), k)
+                - misplaced_large.begin() - 1;
+            unsigned int sb = upper_bound(misplaced_small.begin(), misplaced_small.end(), k)
+                - misplaced_small.begin() - 1;
+            diff_t l = block_split[lb] + (k - misplaced_large[lb]);
+            diff_t s = max(block_first[sb], small_count) + (k - misplaced_small[sb]);
+
+            for (; k < k_last; ++k) {
+                while (k == misplaced_large[lb + 1]) {
+                    ++lb;
+                    l = block_split[lb];
+                }
+                while (k == misplaced_small[sb + 1]) {
+                    ++sb;
+                    s = max(block_first[sb], small_count);
+                }
+                iter_swap(first + l, first + s);
+                ++l;
+                ++s;
+            }
+        });
+
+    return first + small_count;
+}
+
+template<typename T>
+T parallel_minfrom(ThreadPool &pool, T accum,
+                   typename vector<T>::iterator first,
+                   typename vector<T>::iterator last,
+                   size_t serial_cutoff)
+{
+    static_assert(is_unsigned<T>::value, "parallel_minfrom() is only defined for unsigned types");
+    while (static_cast<size_t>(last - first) > serial_cutoff) {
+        T split_value = accum + 1 + (last - first)/2;
+        auto split = parallel_partition(pool, split_value, first, last);
+
+        if (split - first == split_value - accum) {
+            accum = split_value;
+            first = split;
+        } else {
+            last = split;
+        }
+    }
+
+    return minfrom(accum, first, last);
+}
+
+template<typename T>
+T parallel_minfree(vector<T> &v, ThreadPool &pool, size_t serial_cutoff=1 << 16)
+{
+    return parallel_minfrom(pool, static_cast<T>(1), begin(v), end(v), serial_cutoff);
+}
+
 int main()
 {
     using T = unsigned int;
     const unsigned int N_small = 20;
     const unsigned int N_large = 1000000;
 
-    duration_type dt;
+    BenchmarkRunner bench("minfree");
 
-    SequenceGenerator<T, true> small_seq(1, N_small + N_small/10);
-    auto values = benchmark([&small_seq] { return small_seq.generate(N_small); }, dt);
-    cout << "Small set generation: "
-         << chrono::duration_cast<chrono::nanoseconds>(dt).count()
-         << "ns" << endl;
+    auto values = bench.run_with_setup("Small set generation",
+            [] { return SequenceGenerator<T, true>(1, N_small + N_small/10); },
+            [](SequenceGenerator<T, true> &seq) { return seq.generate(N_small); });
 
     for (auto v : values)
         cout << v << " ";
     cout << endl;
 
-    auto res = benchmark([&values] { return minfree(values); }, dt);
-    cout << "Result: " << minfree(values) << endl;
-    cout << "Small set computation: "
-         << chrono::duration_cast<chrono::nanoseconds>(dt).count()
-         << "ns" << endl;
+    auto res = bench.run_with_setup("Small set computation",
+            [&values] { return values; },
+            [](vector<T> &v) { return minfree(v); });
+    cout << "Result: " << res << endl;
 
+    values = bench.run_with_setup("Large set generation",
+            [] { return SequenceGenerator<T, true>(1, N_large + N_large/100); },
+            [](SequenceGenerator<T, true> &seq) { return seq.generate(N_large); });
+
+    ThreadPool pool;
+    auto generated = bench.run_with_setup("Large set parallel generation (" + to_string(pool.size()) + " threads)",
+            [] { return SequenceGenerator<T, true>(1, N_large + N_large/100); },
+            [&pool](SequenceGenerator<T, true> &seq) { return seq.generate(N_large, pool); });
+    ThreadPool single_thread(1);
+    SequenceGenerator<T, true> check_seq(1, N_large + N_large/100);
+    cout << "Parallel generation "
+         << (check_seq.generate(N_large, single_thread) == generated ? "matches" : "differs from")
+         << " the single-threaded run" << endl;
+
+    // The first cached() call writes the cache file if an earlier run has
+    // not; the timed ones only map it.  Its pages are faulted in by the
+    // first pass over the data, not by the load.
     SequenceGenerator<T, true> large_seq(1, N_large + N_large/100);
-    values = benchmark([&large_seq] { return large_seq.generate(N_large); }, dt);
-    cout << "Large set generation: "
-         << chrono::duration_cast<chrono::milliseconds>(dt).count()
-         << "ms" << endl;
-    res = benchmark([&values] { return minfree(values); }, dt);
-    cout << "Result: " << minfree(values) << endl;
-    cout << "Large set computation: "
-         << chrono::duration_cast<chrono::milliseconds>(dt).count()
-         << "ms" << endl;
-
-    benchmark([&values] { sort(begin(values), end(values)); return 0; }, dt);
-    cout << "Reference sort: "
-         << chrono::duration_cast<chrono::milliseconds>(dt).count()
-         << "ms" << endl;
+    large_seq.cached(N_large);
+    auto mapped = bench.run("Large set load from cache",
+            [&large_seq] { return large_seq.cached(N_large); });
+    cout << "Cached set " << (mapped.size() == values.size() && equal(begin(mapped), end(mapped), begin(values)) ? "matches" : "differs from")
+         << " the generated one" << (mapped.mapped() ? "" : " (not mapped)") << endl;
+
+    res = bench.run("Large set read-only computation", [&values] { return minfree_bitmap(values); });
+    cout << "Result: " << res << endl;
+
+    res = bench.run("Large set read-only computation (mapped)",
+            [&mapped] { return minfree_bitmap(begin(mapped), end(mapped)); });
+    cout << "Result: " << res << endl;
+
+    vector<uint64_t> wide_values(begin(values), end(values));
+    auto wide_res = bench.run("Large set read-only computation (64-bit)",
+            [&wide_values] { return minfree_bitmap(wide_values); });
+    cout << "Result: " << wide_res << endl;
+
+    res = bench.run_with_setup("Large set computation",
+            [&values] { return values; },
+            [](vector<T> &v) { return minfree(v); });
+    cout << "Result: " << res << endl;
+
+    res = bench.run_with_setup("Large set parallel computation (" + to_string(pool.size()) + " threads)",
+            [&values] { return values; },
+            [&pool](vector<T> &v) { return parallel_minfree(v, pool); });
+    cout << "Result: " << res << endl;
+
+    const string ids_path = "minfree_ids.bin";
+    {
+        ofstream out(ids_path, ios::binary);
+        out.write(reinterpret_cast<const char *>(values.data()), values.size()*sizeof(T));
+    }
+    for (size_t budget : {size_t(1) << 20, size_t(1) << 14}) {
+        // Reset before every run, so that the counts are those of one call.
+        FileScanStats stats;
+        res = bench.run_with_setup(BenchmarkId("Large set out-of-core computation", "budget", budget),
+                [&stats] { stats = FileScanStats(); return 0; },
+                [&ids_path, budget, &stats](int) { return minfree_file<T>(ids_path, budget, stats); });
+        cout << "Result: " << res << ", " << stats.passes << " passes, "
+             << stats.bytes_read << " bytes read" << endl;
+    }
+    remove(ids_path.c_str());
+
+    bench.run_with_setup("Reference sort",
+            [&values] { return values; },
+            [](vector<T> &v) { sort(begin(v), end(v)); return v.front(); });
+
+    // Allocate/free churn: release a random ID, then ask for the smallest
+    // free one again.
+    const unsigned int N_churn = 100000;
+    const unsigned int N_rounds = 1000;
+    SequenceGenerator<unsigned int> position_seq(0, N_churn - 1);
+    auto positions = position_seq.generate(N_rounds);
+
+    vector<T> ids(N_churn);
+    iota(begin(ids), end(ids), 1);
+    auto checksum = bench.run_with_setup("Churn with repeated minfree",
+            [&ids] { return make_pair(ids, ids); },
+            [&positions](pair<vector<T>, vector<T>> &state) {
+                vector<T> &ids = state.first, &in_use = state.second;
+                T sum = 0;
+                for (auto p : positions) {
+                    *find(begin(in_use), end(in_use), ids[p]) = in_use.back();
+                    in_use.pop_back();
+                    ids[p] = minfree(in_use);
+                    in_use.push_back(ids[p]);
+                    sum += ids[p];
+                }
+                return sum;
+            });
+    cout << "Churn checksum: " << checksum << endl;
+
+    checksum = bench.run_with_setup("Churn with MinFreeAllocator",
+            [] {
+                MinFreeAllocator<T> allocator;
+                auto ids = allocator.acquire_n(N_churn);
+                return make_pair(allocator, ids);
+            },
+            [&positions](pair<MinFreeAllocator<T>, vector<T>> &state) {
+                MinFreeAllocator<T> &allocator = state.first;
+                vector<T> &ids = state.second;
+                T sum = 0;
+                for (auto p : positions) {
+                    allocator.release(ids[p]);
+                    ids[p] = allocator.acquire();
+                    sum += ids[p];
+                }
+                return sum;
+            });
+    cout << "Churn checksum: " << checksum << endl;
 
     return 0;
 }
@@ -0,0 +1,145 @@
+#ifndef MINFREE_ALLOCATOR_H
+#define MINFREE_ALLOCATOR_H
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+// Keeps the set of natural numbers in use and hands out the smallest free
+// one, i.e. what minfree() would return for the current set, without
+// rescanning it.  Bit i of level 0 is set when i + 1 is in use; bit j of a
+// word on level l + 1 is set when word j of level l is full.
+template<typename T>
+class MinFreeAllocator
+{
+    public:
+        MinFreeAllocator() :
+            _levels(1, std::vector<word_t>(1, 0)),
+            _size(0)
+        {
+            static_assert(std::is_unsigned<T>::value, "MinFreeAllocator is only defined for unsigned types");
+        }
+
+        T acquire()
+        {
+            size_t index = first_free();
+            set_used(index);
+            return static_cast<T>(index + 1);
+        }
+
+        // Acquires the k smallest free numbers, taking whole leaf words at
+        // a time.
+        std::vector<T> acquire_n(size_t k)
+        {
+            std::vector<T> result;
+            result.reserve(k);
+            while (k > 0) {
+                size_t index = first_free();
+                size_t word = index/word_bits;
+                word_t free_bits = ~_levels[0][word];
+                while (free_bits != 0 && k > 0) {
+                    result.push_back(static_cast<T>(word*word_bits + ctz(free_bits) + 1));
+                    free_bits &= free_bits - 1;
+                    --k;
+                }
+                word_t taken = ~_levels[0][word] & ~free_bits;
+                _levels[0][word] |= taken;
+                _size += popcount(taken);
+                if (_levels[0][word] == full_word)
+                    mark_full(word);
+            }
+            return result;
+        }
+
+        void release(T x)
+        {
+            if (!in_use(x))
+                throw std::invalid_argument("MinFreeAllocator::release(): value is not in use");
+
+            size_t index = static_cast<size_t>(x) - 1;
+            for (size_t level = 0; level < _levels.size(); ++level) {
+                word_t &w = _levels[level][index/word_bits];
+                bool was_full = w == full_word;
+                w &= ~(word_t(1) << (index%word_bits));
+                if (!was_full)
+                    break;
+                index /= word_bits;
+            }
+            --_size;
+        }
+
+        bool in_use(T x) const
+        {
+            if (x == 0)
+                return false;
+            size_t index = static_cast<size_t>(x) - 1;
+            size_t word = index/word_bits;
+            return word < _levels[0].size() &&
+                (_levels[0][word] >> (index%word_bits) & 1) != 0;
+        }
+
+        size_t size() const
+        {
+            return _size;
+        }
+
+    private:
+        typedef uint64_t word_t;
+        static const unsigned int word_bits = 64;
+        static const word_t full_word = ~word_t(0);
+
+        static unsigned int ctz(word_t w)
+        {
+            return __builtin_ctzll(w);
+        }
+
+        static unsigned int popcount(word_t w)
+        {
+            return __builtin_popcountll(w);
+        }
+
+        // Index of the smallest free bit on level 0, growing the levels
+        // when the descent runs past the words allocated so far.
+        size_t first_free()
+        {
+            if (_levels.back()[0] == full_word)
+                _levels.push_back(std::vector<word_t>(1, 1));
+
+            size_t index = 0;
+            for (size_t level = _levels.size(); level-- > 0; ) {
+                std::vector<word_t> &words = _levels[level];
+                if (index >= words.size())
+                    words.resize(std::max(index + 1, 2*words.size()), 0);
+                index = index*word_bits + ctz(~words[index]);
+            }
+            return index;
+        }
+
+        void set_used(size_t index)
+        {
+            word_t &w = _levels[0][index/word_bits];
+            w |= word_t(1) << (index%word_bits);
+            ++_size;
+            if (w == full_word)
+                mark_full(index/word_bits);
+        }
+
+        // Propagates a newly full word on level 0 towards the root.
+        void mark_full(size_t word)
+        {
+            for (size_t level = 1; level < _levels.size(); ++level) {
+                word_t &w = _levels[level][word/word_bits];
+                w |= word_t(1) << (word%word_bits);
+                if (w != full_word)
+                    break;
+                word /= word_bits;
+            }
+        }
+
+        std::vector<std::vector<word_t>> _levels;
+        size_t _size;
+};
+
+#endif
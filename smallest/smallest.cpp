@@ -1,8 +1,14 @@
 #include "../common/sequence_generator.h"
 #include "../common/common.h"
+#include "../common/benchmark.h"
 
 #include <vector>
 #include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <utility>
 
 using namespace std;
 
@@ -40,7 +46,317 @@ T smallest(int k,
         return *(left_first + k);
 }
 
-int main()
+// a where mask is all ones, b where it is zero.
+inline size_t choose(size_t mask, size_t a, size_t b)
+{
+    return b ^ ((a ^ b) & mask);
+}
+
+// Same halving as smallest(), but the outcomes of the two comparisons are
+// turned into all-ones or all-zero masks and the bounds updated with
+// arithmetic on them, so that the loop body has no conditional jumps
+// (checked in the g++ -O2 and -O3 output for float: setcc and masks, no
+// jcc besides the loop exit).  The probe points of both possible next
+// rounds are prefetched while the current one is resolved.
+template<class T, class I=typename vector<T>::const_iterator>
+T smallest_branchless(size_t k,
+                      I left,  size_t left_size,
+                      I right, size_t right_size)
+{
+    size_t left_first = 0, left_last = left_size;
+    size_t right_first = 0, right_last = right_size;
+
+    while ((left_first != left_last) & (right_first != right_last)) {
+        size_t left_middle = left_first + (left_last - left_first)/2;
+        size_t right_middle = right_first + (right_last - right_first)/2;
+        __builtin_prefetch(&*(left + (left_first + (left_middle - left_first)/2)));
+        __builtin_prefetch(&*(left + (left_middle + (left_last - left_middle)/2)));
+        __builtin_prefetch(&*(right + (right_first + (right_middle - right_first)/2)));
+        __builtin_prefetch(&*(right + (right_middle + (right_last - right_middle)/2)));
+
+        size_t left_count = left_middle - left_first;
+        size_t right_count = right_middle - right_first;
+        size_t less = size_t(0) - size_t(*(left + left_middle) < *(right + right_middle));
+        size_t enough = size_t(0) - size_t(left_count + right_count >= k);
+
+        k -= choose(less, left_count + 1, right_count + 1) & ~enough;
+        right_last = choose(less & enough, right_middle, right_last);
+        left_first = choose(less & ~enough, left_middle + 1, left_first);
+        left_last = choose(~less & enough, left_middle, left_last);
+        right_first = choose(~less & ~enough, right_middle + 1, right_first);
+    }
+
+    if (left_first == left_last)
+        return *(right + (right_first + k));
+    else
+        return *(left + (left_first + k));
+}
+
+template<class T>
+struct ShardElement
+{
+    T value;
+    size_t shard;
+    size_t offset;
+};
+
+// Orders elements by value, then by where they are, so that no two compare
+// equal and every element has a rank of its own.
+template<class T>
+bool before(const ShardElement<T> &a, const ShardElement<T> &b)
+{
+    if (a.value < b.value || b.value < a.value)
+        return a.value < b.value;
+    return a.shard != b.shard ? a.shard < b.shard : a.offset < b.offset;
+}
+
+// Level L of a sorted range is its sorted subsequence of every 2^L-th
+// element, at offsets 2^L - 1, 2^(L+1) - 1, ...; element j of level L + 1
+// is element 2j + 1 of level L.
+template<class I>
+size_t level_size(const pair<I, I> &shard, unsigned int level)
+{
+    return static_cast<size_t>(shard.second - shard.first) >> level;
+}
+
+template<class T, class I>
+ShardElement<T> level_element(const vector<pair<I, I>> &shards, size_t shard, unsigned int level, size_t j)
+{
+    size_t offset = ((j + 1) << level) - 1;
+    ShardElement<T> e = { *(shards[shard].first + offset), shard, offset };
+    return e;
+}
+
+// The elements x1 and x2 of rank k1 <= k2 at the given level of the
+// shards, with ranks1[i] and ranks2[i] the number of elements of shard i
+// at that level ordered before them.  The elements of ranks r1 ~ (k1 - m)/2
+// and r2 ~ k2/2 + 1 one level up bracket k1 and k2 here, and their ranks
+// carry over with one comparison per shard: if i elements of a shard come
+// before y at level L + 1, then 2i or 2i + 1 do at level L.  Between them
+// lie at most k2 - k1 + 2m + 3 candidates, which nth_element() settles, and
+// the gap r2 - r1 stays below m + 5 from one level to the next.
+template<class T, class I>
+void select_pair(const vector<pair<I, I>> &shards, unsigned int level, size_t k1, size_t k2,
+                 ShardElement<T> &x1, vector<size_t> &ranks1,
+                 ShardElement<T> &x2, vector<size_t> &ranks2,
+                 vector<ShardElement<T>> &candidates)
+{
+    const size_t m = shards.size();
+    size_t total = 0, sample_total = 0;
+    for (const auto &shard : shards) {
+        total += level_size(shard, level);
+        sample_total += level_size(shard, level + 1);
+    }
+
+    // Only the elements from ranks1[i] to ranks2[i] of every shard are
+    // left to look at; a small level is searched whole.
+    bool below_all = true, above_all = true;
+    if (total > 4*m) {
+        size_t r1 = k1 >= m ? (k1 - m)/2 : 0;
+        size_t r2 = min(k2/2 + 1, sample_total - 1);
+        select_pair(shards, level + 1, r1, r2, x1, ranks1, x2, ranks2, candidates);
+        below_all = k1 < m;
+        above_all = k2/2 + 1 >= sample_total;
+    }
+    for (size_t i = 0; i < m; ++i) {
+        size_t size = level_size(shards[i], level);
+        if (below_all) {
+            ranks1[i] = 0;
+        } else {
+            size_t r = 2*ranks1[i];
+            ranks1[i] = r < size && before(level_element<T>(shards, i, level, r), x1) ? r + 1 : r;
+        }
+        if (above_all) {
+            ranks2[i] = size;
+        } else {
+            size_t r = 2*ranks2[i];
+            ranks2[i] = r < size && before(level_element<T>(shards, i, level, r), x2) ? r + 1 : r;
+        }
+    }
+
+    candidates.clear();
+    size_t skipped = 0;
+    for (size_t i = 0; i < m; ++i) {
+        skipped += ranks1[i];
+        for (size_t j = ranks1[i]; j < ranks2[i]; ++j)
+            candidates.push_back(level_element<T>(shards, i, level, j));
+    }
+    assert(skipped <= k1 && k2 - skipped < candidates.size());
+
+    // After the two selections the candidates before x1 come first, then
+    // those between x1 and x2, so counting them takes no comparisons.
+    auto order = [](const ShardElement<T> &a, const ShardElement<T> &b) { return before(a, b); };
+    auto middle1 = begin(candidates) + (k1 - skipped);
+    auto middle2 = begin(candidates) + (k2 - skipped);
+    nth_element(begin(candidates), middle2, end(candidates), order);
+    nth_element(begin(candidates), middle1, middle2, order);
+    x1 = *middle1;
+    x2 = *middle2;
+
+    ranks2 = ranks1;
+    for (auto c = begin(candidates); c != middle2; ++c) {
+        ranks1[c->shard] += c < middle1;
+        ranks2[c->shard] += 1;
+    }
+}
+
+// k-th smallest element of the union of several sorted ranges, without
+// merging them, after Frederickson and Johnson's selection in sorted
+// matrices: select_pair() narrows the search from the coarsest level of
+// the ranges down to the ranges themselves, O(m) work per level.  That is
+// O(m log n) comparisons for m ranges of up to n elements, and O(m) space.
+template<class T, class I=typename vector<T>::const_iterator>
+ShardElement<T> smallest(size_t k, const vector<pair<I, I>> &shards)
+{
+    size_t total = 0;
+    for (const auto &shard : shards)
+        total += shard.second - shard.first;
+    assert(k < total);
+
+    ShardElement<T> x1, x2;
+    vector<size_t> ranks1(shards.size()), ranks2(shards.size());
+    vector<ShardElement<T>> candidates;
+    candidates.reserve(6*shards.size() + 8);
+    select_pair(shards, 0, k, k, x1, ranks1, x2, ranks2, candidates);
+    return x1;
+}
+
+// Number of elements the k smallest of the two ranges take from the left
+// one, searched for in [lo, hi].  Ties go to the left range.
+template<class I>
+size_t co_rank(size_t k, size_t lo, size_t hi,
+               I left_first, size_t left_size, I right_first)
+{
+    while (lo < hi) {
+        size_t i = lo + (hi - lo)/2;
+        size_t j = k - i;
+        if (i == left_size || j == 0 || *(right_first + (j - 1)) < *(left_first + i))
+            hi = i;
+        else
+            lo = i + 1;
+    }
+    return lo;
+}
+
+// Solves the middle rank first; the co-ranks of the lower ranks can then
+// be no larger on either side, and those of the higher ranks no smaller,
+// so neighbouring queries share their search bounds.
+template<class T, class I>
+void smallest_batch_helper(vector<size_t>::const_iterator rank_first,
+                           vector<size_t>::const_iterator rank_last,
+                           typename vector<T>::iterator output,
+                           I left_first,  size_t left_size,
+                           I right_first, size_t right_size,
+                           size_t i_lo, size_t i_hi, size_t j_lo, size_t j_hi)
+{
+    if (rank_first == rank_last)
+        return;
+
+    auto rank_middle = rank_first + (rank_last - rank_first)/2;
+    size_t k = *rank_middle;
+    size_t lo = max(i_lo, k > j_hi ? k - j_hi : 0);
+    size_t hi = min(i_hi, k - min(k, j_lo));
+    size_t i = co_rank(k, lo, hi, left_first, left_size, right_first);
+    size_t j = k - i;
+
+    if (j == right_size || (i < left_size && !(*(right_first + j) < *(left_first + i))))
+        output[rank_middle - rank_first] = *(left_first + i);
+    else
+        output[rank_middle - rank_first] = *(right_first + j);
+
+    smallest_batch_helper<T>(rank_first, rank_middle, output,
+            left_first, left_size, right_first, right_size, i_lo, i, j_lo, j);
+    smallest_batch_helper<T>(rank_middle + 1, rank_last, output + (rank_middle - rank_first) + 1,
+            left_first, left_size, right_first, right_size, i, i_hi, j, j_hi);
+}
+
+// The elements of rank ranks[0] < ranks[1] < ... of the union of two sorted
+// ranges.
+template<class T, class I=typename vector<T>::const_iterator>
+vector<T> smallest(const vector<size_t> &ranks,
+                   I left_first,  I left_last,
+                   I right_first, I right_last)
+{
+    assert(is_sorted(begin(ranks), end(ranks)));
+    size_t left_size = left_last - left_first;
+    size_t right_size = right_last - right_first;
+    assert(ranks.empty() || ranks.back() < left_size + right_size);
+
+    vector<T> result(ranks.size());
+    smallest_batch_helper<T>(begin(ranks), end(ranks), begin(result),
+            left_first, left_size, right_first, right_size,
+            0, left_size, 0, right_size);
+    return result;
+}
+
+// Nearest-rank percentiles, given as ascending fractions such as 0.5, 0.9,
+// 0.99 and 0.999.
+template<class T, class I=typename vector<T>::const_iterator>
+vector<T> percentiles(const vector<double> &fractions,
+                      I left_first,  I left_last,
+                      I right_first, I right_last)
+{
+    size_t n = (left_last - left_first) + (right_last - right_first);
+    vector<size_t> ranks;
+    for (auto q : fractions) {
+        size_t rank = static_cast<size_t>(ceil(q*n));
+        ranks.push_back(rank == 0 ? 0 : min(rank, n) - 1);
+    }
+    return smallest<T>(ranks, left_first, left_last, right_first, right_last);
+}
+
+// Times of smallest(), smallest_branchless() and nth_element() on the
+// concatenation for N_queries ranks, for total input sizes 10, 100, ...,
+// max_size.
+void benchmark_sizes(BenchmarkRunner &bench, size_t max_size)
+{
+    const unsigned int N_queries = 1000;
+    SequenceGenerator<float> sequence(-5.0, 5.0);
+
+    for (size_t n = 10; n <= max_size; n *= 10) {
+        auto left = sequence.generate(n/2);
+        auto right = sequence.generate(n - n/2);
+        sort(begin(left), end(left));
+        sort(begin(right), end(right));
+
+        SequenceGenerator<size_t> rank_seq(0, n - 1);
+        auto ranks = rank_seq.generate(N_queries);
+
+        auto reference = bench.run(BenchmarkId("smallest, " + to_string(N_queries) + " queries", "n", n), [&] {
+                vector<float> result;
+                for (auto k : ranks)
+                    result.push_back(smallest<float>(k, begin(left), end(left), begin(right), end(right)));
+                return result;
+            });
+
+        auto branchless = bench.run(BenchmarkId("smallest_branchless, " + to_string(N_queries) + " queries", "n", n), [&] {
+                vector<float> result;
+                for (auto k : ranks)
+                    result.push_back(smallest_branchless<float>(k, begin(left), left.size(),
+                                                                begin(right), right.size()));
+                return result;
+            });
+        assert(reference == branchless);
+
+        vector<float> concatenated(left);
+        concatenated.insert(end(concatenated), begin(right), end(right));
+        shuffle(begin(concatenated), end(concatenated), mt19937(3738u));
+        size_t n_select = max<size_t>(1, min<size_t>(N_queries, 1000000/n));
+        auto selected = bench.run_with_setup(BenchmarkId("nth_element, " + to_string(n_select) + " queries", "n", n),
+            [&concatenated] { return concatenated; },
+            [&ranks, n_select](vector<float> &values) {
+                vector<float> result;
+                for (size_t q = 0; q < n_select; ++q) {
+                    nth_element(begin(values), begin(values) + ranks[q], end(values));
+                    result.push_back(values[ranks[q]]);
+                }
+                return result;
+            });
+        assert(equal(begin(selected), end(selected), begin(reference)));
+    }
+}
+
+int main(int argc, char **argv)
 {
     SequenceGenerator<float> sequence(-5.0, 5.0);
     auto left = sequence.generate(10);
@@ -58,5 +374,62 @@ int main()
     cout << "K=12th smallest: " << smallest<float>(12, begin(left), end(left), begin(right), end(right)) << endl;
     cout << "K=19th smallest: " << smallest<float>(19, begin(left), end(left), begin(right), end(right)) << endl;
 
+    const unsigned int N_shards = 24;
+    vector<vector<float>> shard_values;
+    vector<pair<vector<float>::const_iterator, vector<float>::const_iterator>> shards;
+    vector<float> merged;
+    for (unsigned int i = 0; i < N_shards; ++i) {
+        shard_values.push_back(sequence.generate(i*7 % 50));
+        sort(begin(shard_values.back()), end(shard_values.back()));
+        merged.insert(end(merged), begin(shard_values.back()), end(shard_values.back()));
+    }
+    for (const auto &v : shard_values)
+        shards.push_back(make_pair(begin(v), end(v)));
+    sort(begin(merged), end(merged));
+
+    for (size_t k = 0; k < merged.size(); ++k) {
+        auto e = smallest<float>(k, shards);
+        assert(e.value == merged[k]);
+        assert(shard_values[e.shard][e.offset] == e.value);
+        if (k % 100 == 0)
+            cout << "K=" << k << "th smallest of " << N_shards << " shards: " << e.value
+                 << " (shard " << e.shard << ", offset " << e.offset << ")" << endl;
+    }
+
+    const unsigned int N_latencies = 1000000;
+    const unsigned int N_ranks = 1000;
+    SequenceGenerator<float> latency_seq(0.0, 250.0);
+    auto left_latencies = latency_seq.generate(N_latencies);
+    auto right_latencies = latency_seq.generate(N_latencies);
+    sort(begin(left_latencies), end(left_latencies));
+    sort(begin(right_latencies), end(right_latencies));
+
+    SequenceGenerator<size_t> rank_seq(0, 2*N_latencies - 1);
+    auto ranks = rank_seq.generate(N_ranks);
+    sort(begin(ranks), end(ranks));
+
+    BenchmarkRunner bench("smallest");
+    auto looped = bench.run(to_string(N_ranks) + " ranks with smallest() in a loop", [&] {
+            vector<float> result;
+            for (auto k : ranks)
+                result.push_back(smallest<float>(k, begin(left_latencies), end(left_latencies),
+                                                 begin(right_latencies), end(right_latencies)));
+            return result;
+        });
+
+    auto batched = bench.run(to_string(N_ranks) + " ranks with batched smallest()", [&] {
+            return smallest<float>(ranks, begin(left_latencies), end(left_latencies),
+                                   begin(right_latencies), end(right_latencies));
+        });
+    assert(looped == batched);
+
+    auto p = percentiles<float>({0.5, 0.9, 0.99, 0.999},
+            begin(left_latencies), end(left_latencies),
+            begin(right_latencies), end(right_latencies));
+    cout << "p50=" << p[0] << " p90=" << p[1] << " p99=" << p[2] << " p999=" << p[3] << endl;
+
+    // The largest size can be raised up to 10^9 from the command line.
+    benchmark_sizes(bench, argc > 1 ? strtoull(argv[1], nullptr, 10) : 10000000);
+
     return 0;
 }